@@ -0,0 +1,110 @@
+/* query search.idx written by stagit -i, see stagit(1) for the format */
+(function() {
+	var form = document.getElementById("search"),
+	    input = document.getElementById("q"),
+	    results = document.getElementById("results"),
+	    idx = null;
+
+	function load(cb) {
+		var x = new XMLHttpRequest();
+		x.open("GET", "search.idx");
+		x.responseType = "arraybuffer";
+		x.onload = function() { cb(parse(x.response)); };
+		x.send();
+	}
+
+	function parse(buf) {
+		var v = new DataView(buf), b = new Uint8Array(buf), dec = new TextDecoder(),
+		    off = 16, ndocs = v.getUint32(8, true), ntri = v.getUint32(12, true),
+		    docs = [], tris = {}, i, n, d, t;
+
+		if (dec.decode(b.subarray(0, 4)) !== "STGS")
+			return null;
+		for (i = 0; i < ndocs; i++) {
+			d = { type: String.fromCharCode(b[off]) };
+			n = v.getUint16(off + 1, true);
+			d.url = dec.decode(b.subarray(off + 3, off + 3 + n));
+			off += 3 + n;
+			n = v.getUint16(off, true);
+			d.label = dec.decode(b.subarray(off + 2, off + 2 + n));
+			off += 2 + n;
+			docs.push(d);
+		}
+		for (i = 0; i < ntri; i++, off += 12) {
+			t = v.getUint32(off, true);
+			tris[t] = [v.getUint32(off + 4, true), v.getUint32(off + 8, true)];
+		}
+		return { docs: docs, tris: tris, post: b.subarray(off) };
+	}
+
+	function decode(t) {
+		var e = idx.tris[t], out = [], p, doc = 0, i, v, shift, c;
+
+		if (!e)
+			return out;
+		for (p = e[0], i = 0; i < e[1]; i++) {
+			for (v = 0, shift = 0; ; shift += 7) {
+				c = idx.post[p++];
+				v += (c & 0x7f) * Math.pow(2, shift);
+				if (!(c & 0x80))
+					break;
+			}
+			doc += v;
+			out.push(doc);
+		}
+		return out;
+	}
+
+	/* trigrams the same way as stagit: lowercase ASCII, whitespace as space */
+	function trigrams(q) {
+		var b = new TextEncoder().encode(q), out = [], t = 0, i, c;
+
+		for (i = 0; i < b.length; i++) {
+			c = b[i];
+			if (c >= 65 && c <= 90)
+				c |= 0x20;
+			else if (c === 10 || c === 13 || c === 9)
+				c = 32;
+			t = ((t << 8) | c) & 0xffffff;
+			if (i >= 2 && out.indexOf(t) === -1)
+				out.push(t);
+		}
+		return out;
+	}
+
+	function search(q) {
+		var tri = trigrams(q), docs = null, i, j, p, tr, td, a;
+
+		while (results.firstChild)
+			results.removeChild(results.firstChild);
+		if (!tri.length)
+			return;
+		for (i = 0; i < tri.length && (docs === null || docs.length); i++) {
+			p = decode(tri[i]);
+			docs = docs === null ? p : docs.filter(function(d) { return p.indexOf(d) !== -1; });
+		}
+		/* the trigrams of the query are all in each document, the
+		   text itself is not verified */
+		for (j = 0; j < docs.length && j < 500; j++) {
+			tr = document.createElement("tr");
+			td = document.createElement("td");
+			td.textContent = idx.docs[docs[j]].type === "C" ? "commit" : "file";
+			tr.appendChild(td);
+			td = document.createElement("td");
+			a = document.createElement("a");
+			a.href = idx.docs[docs[j]].url;
+			a.textContent = idx.docs[docs[j]].label;
+			td.appendChild(a);
+			tr.appendChild(td);
+			results.appendChild(tr);
+		}
+	}
+
+	form.onsubmit = function(e) {
+		e.preventDefault();
+		if (idx)
+			search(input.value);
+		else
+			load(function(i) { idx = i; if (idx) search(input.value); });
+	};
+})();
@@ -1,14 +1,18 @@
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
-#include <libgen.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -19,6 +23,51 @@
 
 #define LEN(s)    (sizeof(s)/sizeof(*s))
 
+/* commits over these limits get a diff page per file */
+#define DIFF_MAXFILES  1000
+#define DIFF_MAXLINES  100000
+/* limits for split commits: files with a diff page, lines of one file */
+#define SPLIT_MAXFILES 10000
+#define SPLIT_MAXLINES 100000
+/* milliseconds for the diff pages of a split commit, later files only get
+   a notice */
+#define SPLIT_MAXTIME  (60 * 1000)
+/* larger files get no blame page */
+#define BLAME_MAXSIZE  (1024 * 1024)
+/* larger files are not in the search index */
+#define SEARCH_MAXSIZE (1024 * 1024)
+/* --estimate: assumed bytes of a page without content, of a line of a file
+   page and the average length of a line */
+#define EST_PAGE       2048
+#define EST_LINE       48
+#define EST_LINELEN    40
+#define EST_TOP        10
+/* pages queued for the writer threads before rendering waits */
+#define WRITE_MAXQUEUED (64 * 1024 * 1024)
+/* --max-memory: assumed bytes of a diff line in memory with its patch */
+#define MEM_DIFFLINE   256
+/* -H: version of the lexer in the content cache key, raise it when the
+   output of hllex() changes */
+#define HL_VERSION     2
+/* -t: assumed speed of the similarity pass, bytes of blob hashed and pairs
+   of files compared per millisecond */
+#define FIND_BYTESMS   (64 * 1024)
+#define FIND_PAIRSMS   1000
+
+/* block of an arena, the allocations follow the header */
+struct arenablock {
+	struct arenablock *next;
+	size_t size;
+	size_t used;
+};
+
+/* Bump allocator, all its allocations are released at once by arena_reset()
+   which keeps the blocks for reuse. */
+struct arena {
+	struct arenablock *first;
+	struct arenablock *cur;
+};
+
 struct deltainfo {
 	git_patch *patch;
 	size_t addcount;
@@ -26,6 +75,7 @@ struct deltainfo {
 };
 
 struct commitinfo {
+	struct arena *arena; /* commitinfo and deltas are allocated from it */
 	const git_oid *id;
 
 	char oid[GIT_OID_HEXSZ + 1];
@@ -48,6 +98,178 @@ struct commitinfo {
 
 	struct deltainfo **deltas;
 	size_t ndeltas;
+	int split; /* too large for one page, patches are not kept */
+	int nofind; /* rename/copy detection skipped: FIND_SKIP_* */
+};
+
+enum { FIND_SKIP_NONE = 0, FIND_SKIP_DELTAS, FIND_SKIP_TIME };
+
+/* per-file history: commits and the changed paths of each commit */
+struct histcommit {
+	char oid[GIT_OID_HEXSZ + 1];
+	git_time_t time;
+	char *summary;
+};
+
+struct histrow {
+	size_t commit; /* index in histcommits */
+	size_t addcount;
+	size_t delcount;
+};
+
+struct histpath {
+	char *path;
+	struct histrow *rows;
+	size_t nrows;
+	int changed; /* -p: changed by a commit of the push */
+};
+
+/* Markdown file in HEAD to render to render/<path>.html */
+struct mdjob {
+	git_blob *blob;
+	char *path;
+	char *name;
+	char *html;
+	size_t htmllen;
+};
+
+/* Formatted dates of recently seen days: the rows of a log are mostly sorted
+   by time so they share a few days, only the time of day is computed. */
+struct dayfmt {
+	long long day;
+	int valid;
+	char ymd[16];  /* %Y-%m-%d */
+	char full[32]; /* %a, %e %b %Y */
+};
+
+/* State of one renderer: its own repository handle, the path from the page
+   being written to the top of the output directory and its scratch state,
+   so renderers in different threads share nothing. */
+struct renderctx {
+	git_repository *repo;
+	const char *relpath;
+	struct dayfmt dayfmts[8];
+	struct arena arena; /* per-commit state in writelog() */
+	/* -H statistics */
+	size_t hlfiles, hlcached;
+	long long hltime; /* microseconds spent highlighting */
+	/* first-parent commits after blamerangebase up to HEAD, oldest first */
+	git_oid *blamerange, blamerangebase;
+	size_t nblamerange;
+	int hasblamerange;
+};
+
+/* file in HEAD to write blame/<path>.html for */
+struct blamejob {
+	git_oid id;
+	char *path;
+	char *name;
+};
+
+/* row of files.html in .stagit-files */
+struct fileent {
+	char *path;
+	git_oid id;
+	size_t lc;
+	size_t size;
+	int binary;
+};
+
+/* prebuilt output */
+struct fragment {
+	char *data;
+	size_t len;
+};
+
+/* document of the search index with its sorted trigrams */
+struct searchdoc {
+	int type; /* 'F': file in HEAD, 'C': commit */
+	git_oid id; /* blob or commit id, the trigrams only depend on it */
+	char *url;
+	char *label;
+	uint32_t *tri;
+	size_t ntri;
+};
+
+/* language of the syntax highlighter, the keywords are sorted for bsearch() */
+struct lang {
+	const char *name;
+	const char *exts; /* suffixes of the file name, separated by a space */
+	const char *linecomment;
+	const char *blockstart;
+	const char *blockend;
+	const char *quotes;
+	int preproc; /* '#' at the start of a line until the end of it */
+	int wordcomment; /* the line comment only starts after a blank */
+	const char *const *keywords;
+	size_t nkeywords;
+};
+
+/* Backend for the pages: a page is rendered to memory and submitted when it
+   is complete, the backend owns path and buf from then on. */
+struct outbackend {
+	const char *name;
+	void (*start)(void);
+	void (*submit)(char *path, char *buf, size_t len);
+	void (*finish)(void);
+};
+
+/* page rendered to memory for the backend, without one written to the
+   temporary file tmppath */
+struct openpage {
+	FILE *fp;
+	char *path;
+	char *tmppath;
+	char *buf;
+	size_t len;
+};
+
+struct writejob {
+	char *path;
+	char *buf;
+	size_t len;
+	struct writejob *next;
+};
+
+/* file in the bundle: offset of its data in the tar */
+struct bundleent {
+	char *path;
+	long long offset;
+	long long size;
+	git_oid hash;
+};
+
+/* largest commit or blob of the estimate */
+struct estitem {
+	long long size;
+	char *name;
+};
+
+/* log line of a commit, shared by the log pages of all branches */
+struct logrow {
+	char oid[GIT_OID_HEXSZ + 1];
+	char *summary;
+	git_time when;
+	int hasauthor;
+	size_t filecount;
+	size_t addcount;
+	size_t delcount;
+	int used; /* in a branch log of this run */
+};
+
+/* set of paths, open addressing */
+struct pathset {
+	char **slots;
+	size_t cap;
+	size_t n;
+};
+
+/* output file in the manifest */
+struct manifestent {
+	char *path;
+	long long size;
+	struct timespec mtime;
+	git_oid hash;
 };
 
 /* reference and associated data for sorting */
@@ -58,8 +280,14 @@ struct referenceinfo {
 
 static git_repository *repo;
 
+static struct arena refsarena;   /* commits of the reference snapshot */
+
 static const char *baseurl = ""; /* base URL to make absolute RSS/Atom URI */
-static const char *relpath = "";
+static struct renderctx mainctx; /* renderer of the main thread */
+/* page header after the title by relpath depth, built on first use */
+static struct fragment *headertails;
+static size_t nheadertails;
+static pthread_mutex_t headerlock = PTHREAD_MUTEX_INITIALIZER;
 static const char *repodir;
 
 static char *name = "";
@@ -72,12 +300,137 @@ static char *license;
 static char *readmefiles[] = { "HEAD:README", "HEAD:README.md" };
 static char *readme;
 static long long nlogcommits = -1; /* -1 indicates not used */
+static int compact; /* -s: line numbers by CSS counters, no per-line links */
+/* rename and copy detection: level (-r), maximum deltas (-R) and time budget
+   per commit in milliseconds (-t), 0 is no limit */
+static unsigned int findflags = GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_COPIES |
+                                GIT_DIFF_FIND_EXACT_MATCH_ONLY;
+static long long findmaxdeltas, findbudget;
+/* -f: per-file history pages, newest commit first */
+static int filehist;
+static struct histcommit *histcommits;
+static size_t nhistcommits;
+static struct histpath *histpaths; /* open addressing, size is a power of 2 */
+static size_t histpathcap, nhistpaths;
+/* -a: blame pages, the commit of each line is cached per path and blob id */
+static int blame;
+static const char *blamecachedir = ".stagit-blame";
+static const git_oid *blamehead;
+/* blame pages, written in parallel after the files */
+static struct blamejob *blamejobs;
+static size_t nblamejobs, blamejobnext;
+static pthread_mutex_t blamejobmtx = PTHREAD_MUTEX_INITIALIZER;
+/* a repository handle per worker, libgit2 objects are not shared between
+   threads */
+static git_repository *repopool[16];
+/* -i: search index search.idx, the trigrams of each document are kept in
+   .stagit-search and reused by object id in the next run */
+static int searchindex;
+static const char *searchstate = ".stagit-search";
+static struct searchdoc *searchdocs, *prevdocs;
+static size_t nsearchdocs, nprevdocs;
+static size_t *prevdoctab, prevdoctabcap; /* index + 1 by object id */
+/* -m: manifest of the output files in .stagit-manifest and the changes to the
+   previous one in .stagit-changes */
+static int manifest;
+static const char *manifestfile = ".stagit-manifest", *changesfile = ".stagit-changes";
+/* -H: syntax highlighting, the highlighted lines are kept in the content
+   cache by blob id and language */
+static int syntax;
+/* -p: ref updates of a post-receive hook on stdin, only the pages of HEAD
+   are written when its branch was updated and then only for changed files */
+static int postreceive, headupdated, haschanged;
+static struct pathset changedpaths;
+/* -p with -f: the commits of the push, the history pages of their paths are
+   written even when the file is the same in the old and new tree */
+static struct pathset newcommits;
+static git_oid headold; /* old commit of the branch of HEAD */
+static int hasheadold;
+/* without -c the rows of log.html and the count of the commits not shown,
+   -p only walks the new commits and copies the rows of the older ones */
+static const char *logstate = ".stagit-log";
+static char logstatetmp[64] = ".stagit-log.XXXXXXXXXXXX";
+static FILE *rlogfp, *wlogfp;
+static size_t logstaterem;
+/* rows of files.html by path with the blob id, -p reuses the rows of the
+   files whose blob did not change without reading them */
+static const char *filesstate = ".stagit-files";
+static char filesstatetmp[64] = ".stagit-files.XXXXXXXXXXXX";
+static struct fileent *prevfiles;
+static size_t nprevfiles, *prevfiletab, prevfiletabcap;
+static FILE *wfilesfp;
+/* commits of the -c cache which are no longer in HEAD after a force-push */
+static struct pathset droppedcommits;
+/* -g: remove the pages of commits and files which are no longer reachable */
+static int collect;
+/* -b: log pages of branches in log/, the log line of each commit is only
+   computed once for all of them, by oid */
+static char **logbranches;
+static size_t nlogbranches;
+static long long nbranchcommits; /* -l for the branch logs */
+static struct logrow *logrows;
+static size_t nlogrows, logrowcap;
+/* -W: pages are written by a backend, without it directly with stdio */
+static const struct outbackend *outbackend;
+/* pages open in the main thread and the blame workers */
+static struct openpage openpages[4 + LEN(repopool)];
+static pthread_mutex_t pagelock = PTHREAD_MUTEX_INITIALIZER;
+static mode_t pagemode = 0644; /* 0666 without the umask */
+static long long nwriters;
+static pthread_t writers[32];
+static pthread_mutex_t writelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writenotempty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writenotfull = PTHREAD_COND_INITIALIZER;
+static struct writejob *writehead, *writetail;
+static size_t writequeued; /* bytes */
+static int writedone, writeerr;
+/* -S: sync the output once at the end, then mark it complete by replacing
+   .stagit-generation */
+static int durable;
+static const char *generationfile = ".stagit-generation";
+/* --estimate: only report what would be written */
+static int estimateonly;
+/* --max-memory: budget of the peak RSS in bytes, setbudget() lowers the
+   limits below to fit it */
+static long long maxmemory;
+static git_odb *budgetodb;
+static size_t diffmaxlines = DIFF_MAXLINES, splitmaxlines = SPLIT_MAXLINES;
+static size_t writemaxqueued = WRITE_MAXQUEUED;
+static size_t blobmaxsize; /* larger files get a page without content */
+/* -B: tar bundle of the output directory with an index, updated by appending
+   the files whose hash changed */
+static const char *bundlefile;
+/* commit pages on disk, .stagit-commits has their ids sorted so the log
+   does not check for commit/<oid>.html of every commit */
+static const char *commitsfile = ".stagit-commits";
+static git_oid *rendered;
+static char *renderedgone; /* page removed in this run */
+static size_t nrendered;
+static struct pathset renderedadd; /* pages written in this run */
+/* directories created by mkdirp() in this run */
+static struct pathset dircache;
+static pthread_mutex_t dircachelock = PTHREAD_MUTEX_INITIALIZER;
+/* in compact mode a click on a line element links to its id */
+static const char compactclick[] = " onclick=\"if(event.target.id)location.hash=event.target.id\"";
 
 /* cache */
 static git_oid lastoid;
 static char lastoidstr[GIT_OID_HEXSZ + 2]; /* id + newline + NUL byte */
 static FILE *rcachefp, *wcachefp;
 static const char *cachefile;
+/* changed paths of the cached commits for -f: <cachefile>.paths */
+static char pathscache[PATH_MAX], pathstmp[64] = "paths.XXXXXXXXXXXX";
+/* rows of the branch logs for -c: <cachefile>.branches */
+static char branchescache[PATH_MAX], branchestmp[64] = "branches.XXXXXXXXXXXX";
+static FILE *rpathsfp, *wpathsfp;
+/* rendered content by blob id, can be shared by repositories */
+static const char *contentcache;
+/* Markdown pages, rendered in parallel after the files are written */
+static struct mdjob *mdjobs;
+static size_t nmdjobs, mdjobnext;
+static pthread_mutex_t mdjobmtx = PTHREAD_MUTEX_INITIALIZER;
+/* reference snapshot for refs.html and tags.xml, keyed by the ref state */
+static const char *refscachefile = ".stagit-refs";
 
 /* Handle read or write errors for a FILE * stream */
 void checkfileerror(FILE *fp, const char *name, int mode) {
@@ -94,12 +447,141 @@ void joinpath(char *buf, size_t bufsiz, const char *path, const char *path2) {
 		errx(1, "path truncated: '%s%s%s'", path, path[0] && path[strlen(path) - 1] != '/' ? "/" : "", path2);
 }
 
+/* monotonic clock in milliseconds */
+long long
+nowms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* monotonic clock in microseconds */
+long long
+nowus(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#define ARENA_ALIGN     16
+#define ARENA_BLOCKSIZE (64 * 1024)
+
+/* Zeroed allocation of nmemb * size bytes from the arena. */
+void *
+arena_calloc(struct arena *a, size_t nmemb, size_t size)
+{
+	struct arenablock *b;
+	char *p;
+	size_t hdr = (sizeof(struct arenablock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (size && nmemb > (SIZE_MAX - ARENA_BLOCKSIZE) / size)
+		errx(1, "arena: allocation too large");
+	size = (nmemb * size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	/* use the current block or the next kept block if it fits */
+	for (b = a->cur; b && b->size - b->used < size; b = b->next)
+		;
+	if (!b) {
+		if (!(b = malloc(hdr + (size > ARENA_BLOCKSIZE ? size : ARENA_BLOCKSIZE))))
+			err(1, "malloc");
+		b->size = size > ARENA_BLOCKSIZE ? size : ARENA_BLOCKSIZE;
+		b->used = 0;
+		if (a->cur) {
+			b->next = a->cur->next;
+			a->cur->next = b;
+		} else {
+			b->next = a->first;
+			a->first = b;
+		}
+	}
+	a->cur = b;
+
+	p = (char *)b + hdr + b->used;
+	b->used += size;
+	memset(p, 0, size);
+
+	return p;
+}
+
+void
+arena_reset(struct arena *a)
+{
+	struct arenablock *b;
+
+	for (b = a->first; b; b = b->next)
+		b->used = 0;
+	a->cur = a->first;
+}
+
+void
+arena_free(struct arena *a)
+{
+	struct arenablock *b, *next;
+
+	for (b = a->first; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+	a->first = a->cur = NULL;
+}
+
+/* NOTE: the deltainfo memory itself belongs to the commit arena. */
 void deltainfo_free(struct deltainfo *di) {
 	if (!di)
 		return;
 	git_patch_free(di->patch);
 	memset(di, 0, sizeof(*di));
-	free(di);
+}
+
+/* -t: estimate the milliseconds of the similarity pass from the sizes of the
+   candidate blobs in the object headers, the pass itself cannot be stopped */
+long long
+findcost(struct commitinfo *ci)
+{
+	const git_diff_delta *delta;
+	git_odb *odb;
+	git_otype type;
+	size_t i, n, len, nsrc = 0, ntgt = 0;
+	long long bytes = 0;
+
+	if (findflags & GIT_DIFF_FIND_EXACT_MATCH_ONLY)
+		return 0;
+	if (git_repository_odb(&odb, git_commit_owner(ci->commit)))
+		return 0;
+	n = git_diff_num_deltas(ci->diff);
+	for (i = 0; i < n; i++) {
+		delta = git_diff_get_delta(ci->diff, i);
+		switch (delta->status) {
+		case GIT_DELTA_ADDED:
+			ntgt++;
+			if (!git_odb_read_header(&len, &type, odb, &delta->new_file.id))
+				bytes += len;
+			break;
+		case GIT_DELTA_DELETED:
+		case GIT_DELTA_MODIFIED:
+			/* modified files are copy sources */
+			if (delta->status == GIT_DELTA_MODIFIED &&
+			    !(findflags & GIT_DIFF_FIND_COPIES))
+				break;
+			nsrc++;
+			if (!git_odb_read_header(&len, &type, odb, &delta->old_file.id))
+				bytes += len;
+			break;
+		default:
+			break;
+		}
+	}
+	git_odb_free(odb);
+
+	if (!nsrc || !ntgt)
+		return 0;
+	return bytes / FIND_BYTESMS + (long long)(nsrc * ntgt) / FIND_PAIRSMS;
 }
 
 int commitinfo_getstats(struct commitinfo *ci) {
@@ -112,11 +594,12 @@ int commitinfo_getstats(struct commitinfo *ci) {
 	git_patch *patch = NULL;
 	size_t ndeltas, nhunks, nhunklines;
 	size_t i, j, k;
+	long long start = findbudget ? nowms() : 0;
 
-	if (git_tree_lookup(&(ci->commit_tree), repo, git_commit_tree_id(ci->commit)))
+	if (git_commit_tree(&(ci->commit_tree), ci->commit))
 		goto err;
 	if (!git_commit_parent(&(ci->parent), ci->commit, 0)) {
-		if (git_tree_lookup(&(ci->parent_tree), repo, git_commit_tree_id(ci->parent))) {
+		if (git_commit_tree(&(ci->parent_tree), ci->parent)) {
 			ci->parent = NULL;
 			ci->parent_tree = NULL;
 		}
@@ -124,35 +607,56 @@ int commitinfo_getstats(struct commitinfo *ci) {
 
 	git_diff_init_options(&opts, GIT_DIFF_OPTIONS_VERSION);
 	opts.flags |= GIT_DIFF_DISABLE_PATHSPEC_MATCH | GIT_DIFF_IGNORE_SUBMODULES |  GIT_DIFF_INCLUDE_TYPECHANGE;
-	if (git_diff_tree_to_tree(&(ci->diff), repo, ci->parent_tree, ci->commit_tree, &opts))
+	/* --max-memory: larger blobs are not loaded, their patch is binary */
+	if (blobmaxsize)
+		opts.max_size = blobmaxsize;
+	/* the repository of the commit, each renderer thread has its own */
+	if (git_diff_tree_to_tree(&(ci->diff), git_commit_owner(ci->commit),
+	                          ci->parent_tree, ci->commit_tree, &opts))
 		goto err;
 
-	if (git_diff_find_init_options(&fopts, GIT_DIFF_FIND_OPTIONS_VERSION))
-		goto err;
-	/* find renames and copies, exact matches (no heuristic) for renames. */
-	fopts.flags |= GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_COPIES |
-	               GIT_DIFF_FIND_EXACT_MATCH_ONLY;
-	if (git_diff_find_similar(ci->diff, &fopts))
-		goto err;
+	/* find renames and copies, by default exact matches (no heuristic).
+	   The similarity pass cannot be interrupted: skip it for too many
+	   deltas or when its estimate does not fit in what is left of the
+	   time budget after the tree diff. */
+	ndeltas = git_diff_num_deltas(ci->diff);
+	if (findflags && findmaxdeltas && ndeltas > (size_t)findmaxdeltas) {
+		ci->nofind = FIND_SKIP_DELTAS;
+	} else if (findflags && findbudget &&
+	           nowms() - start + findcost(ci) > findbudget) {
+		ci->nofind = FIND_SKIP_TIME;
+	} else if (findflags) {
+		if (git_diff_find_init_options(&fopts, GIT_DIFF_FIND_OPTIONS_VERSION))
+			goto err;
+		fopts.flags |= findflags;
+		if (findmaxdeltas)
+			fopts.rename_limit = findmaxdeltas;
+		if (git_diff_find_similar(ci->diff, &fopts))
+			goto err;
+	}
 
 	ndeltas = git_diff_num_deltas(ci->diff);
-	if (ndeltas && !(ci->deltas = calloc(ndeltas, sizeof(struct deltainfo *))))
-		err(1, "calloc");
+	if (ndeltas)
+		ci->deltas = arena_calloc(ci->arena, ndeltas, sizeof(struct deltainfo *));
 
 	for (i = 0; i < ndeltas; i++) {
 		if (git_patch_from_diff(&patch, ci->diff, i))
 			goto err;
 
-		if (!(di = calloc(1, sizeof(struct deltainfo))))
-			err(1, "calloc");
+		di = arena_calloc(ci->arena, 1, sizeof(struct deltainfo));
 		di->patch = patch;
 		ci->deltas[i] = di;
 
 		delta = git_patch_get_delta(patch);
 
 		/* skip stats for binary data */
-		if (delta->flags & GIT_DIFF_FLAG_BINARY)
+		if (delta->flags & GIT_DIFF_FLAG_BINARY) {
+			if (ci->split) {
+				git_patch_free(di->patch);
+				di->patch = NULL;
+			}
 			continue;
+		}
 
 		nhunks = git_patch_num_hunks(patch);
 		for (j = 0; j < nhunks; j++) {
@@ -170,6 +674,21 @@ int commitinfo_getstats(struct commitinfo *ci) {
 				}
 			}
 		}
+
+		/* too large for one page: only keep the stats, the diff pages
+		   of the files regenerate their patch one at a time */
+		if (!ci->split && (ndeltas > DIFF_MAXFILES ||
+		    ci->addcount > diffmaxlines || ci->delcount > diffmaxlines)) {
+			ci->split = 1;
+			for (j = 0; j < i; j++) {
+				git_patch_free(ci->deltas[j]->patch);
+				ci->deltas[j]->patch = NULL;
+			}
+		}
+		if (ci->split) {
+			git_patch_free(di->patch);
+			di->patch = NULL;
+		}
 	}
 	ci->ndeltas = i;
 	ci->filecount = i;
@@ -189,16 +708,18 @@ err:
 	if (ci->deltas)
 		for (i = 0; i < ci->ndeltas; i++)
 			deltainfo_free(ci->deltas[i]);
-	free(ci->deltas);
 	ci->deltas = NULL;
 	ci->ndeltas = 0;
 	ci->addcount = 0;
 	ci->delcount = 0;
 	ci->filecount = 0;
+	ci->nofind = FIND_SKIP_NONE;
 
 	return -1;
 }
 
+/* Free the libgit2 objects of the commit, its memory is released with the
+   arena it was allocated from. */
 void commitinfo_free(struct commitinfo *ci) {
 	size_t i;
 	if (!ci)
@@ -206,21 +727,19 @@ void commitinfo_free(struct commitinfo *ci) {
 	if (ci->deltas)
 		for (i = 0; i < ci->ndeltas; i++)
 			deltainfo_free(ci->deltas[i]);
-	free(ci->deltas);
 	git_diff_free(ci->diff);
 	git_tree_free(ci->commit_tree);
 	git_tree_free(ci->parent_tree);
 	git_commit_free(ci->commit);
 	git_commit_free(ci->parent);
 	memset(ci, 0, sizeof(*ci));
-	free(ci);
 }
 
-struct commitinfo * commitinfo_getbyoid(const git_oid *id) {
+struct commitinfo * commitinfo_getbyoid(struct renderctx *ctx, const git_oid *id, struct arena *a) {
 	struct commitinfo *ci;
-	if (!(ci = calloc(1, sizeof(struct commitinfo))))
-		err(1, "calloc");
-	if (git_commit_lookup(&(ci->commit), repo, id))
+	ci = arena_calloc(a, 1, sizeof(struct commitinfo));
+	ci->arena = a;
+	if (git_commit_lookup(&(ci->commit), ctx->repo, id))
 		goto err;
 	ci->id = id;
 	git_oid_tostr(ci->oid, sizeof(ci->oid), git_commit_id(ci->commit));
@@ -287,7 +806,7 @@ int getrefs(struct referenceinfo **pris, size_t *prefcount) {
 			goto err;
 		if (!(id = git_object_id(obj)))
 			goto err;
-		if (!(ci = commitinfo_getbyoid(id)))
+		if (!(ci = commitinfo_getbyoid(&mainctx, id, &refsarena)))
 			break;
 
 		if (!(ris = reallocarray(ris, refcount + 1, sizeof(*ris))))
@@ -320,10 +839,126 @@ err:
 		git_reference_free(ris[i].ref);
 	}
 	free(ris);
+	arena_free(&refsarena);
 
 	return -1;
 }
 
+void
+freerefs(struct referenceinfo *ris, size_t refcount)
+{
+	size_t i;
+
+	for (i = 0; i < refcount; i++) {
+		commitinfo_free(ris[i].ci);
+		git_reference_free(ris[i].ref);
+	}
+	free(ris);
+	arena_free(&refsarena);
+}
+
+/* FNV-1a hash */
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+
+uint64_t
+fnv1a(uint64_t h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+int
+pathset_has(const struct pathset *ps, const char *path)
+{
+	size_t i;
+
+	if (!ps->cap)
+		return 0;
+	for (i = fnv1a(FNV1A_INIT, path, strlen(path)) & (ps->cap - 1); ps->slots[i];
+	     i = (i + 1) & (ps->cap - 1))
+		if (!strcmp(ps->slots[i], path))
+			return 1;
+	return 0;
+}
+
+void
+pathset_insert(struct pathset *ps, char *path)
+{
+	size_t i;
+
+	for (i = fnv1a(FNV1A_INIT, path, strlen(path)) & (ps->cap - 1); ps->slots[i];
+	     i = (i + 1) & (ps->cap - 1))
+		;
+	ps->slots[i] = path;
+	ps->n++;
+}
+
+void
+pathset_add(struct pathset *ps, const char *path)
+{
+	char **old = ps->slots, *s;
+	size_t i, oldcap = ps->cap;
+
+	if (pathset_has(ps, path))
+		return;
+	if ((ps->n + 1) * 2 > ps->cap) {
+		ps->cap = ps->cap ? ps->cap * 2 : 256;
+		if (!(ps->slots = calloc(ps->cap, sizeof(*ps->slots))))
+			err(1, "calloc");
+		ps->n = 0;
+		for (i = 0; i < oldcap; i++)
+			if (old[i])
+				pathset_insert(ps, old[i]);
+		free(old);
+	}
+	if (!(s = strdup(path)))
+		err(1, "strdup");
+	pathset_insert(ps, s);
+}
+
+/* Key of the reference state: the name and direct target of each branch and
+   tag, independent of the iteration order. Only the loose and packed refs are
+   read, nothing is peeled or looked up. */
+int
+getrefskey(char *key, size_t keysiz)
+{
+	git_reference_iterator *it = NULL;
+	git_reference *ref = NULL;
+	const git_oid *id;
+	const char *s;
+	uint64_t h, sum = 0, n = 0;
+
+	if (git_reference_iterator_new(&it, repo))
+		return -1;
+	while (!git_reference_next(&ref, it)) {
+		if (git_reference_is_branch(ref) || git_reference_is_tag(ref)) {
+			s = git_reference_name(ref);
+			h = fnv1a(FNV1A_INIT, s, strlen(s) + 1);
+			if ((id = git_reference_target(ref)))
+				h = fnv1a(h, id->id, sizeof(id->id));
+			else if ((s = git_reference_symbolic_target(ref)))
+				h = fnv1a(h, s, strlen(s) + 1);
+			sum += h;
+			n++;
+		}
+		git_reference_free(ref);
+	}
+	git_reference_iterator_free(it);
+
+	/* the feed links depend on the base URL */
+	h = fnv1a(FNV1A_INIT, baseurl, strlen(baseurl) + 1);
+	snprintf(key, keysiz, "%016llx%016llx%llu", (unsigned long long)sum,
+	         (unsigned long long)h, (unsigned long long)n);
+
+	return 0;
+}
+
 FILE * efopen(const char *filename, const char *flags) {
 	FILE *fp;
 
@@ -333,6 +968,240 @@ FILE * efopen(const char *filename, const char *flags) {
 	return fp;
 }
 
+/* Create the temporary file of the output file path: a dotfile in the same
+   directory, so it is renamed over path and skipped by the manifest. */
+int
+mktmpfile(char *tmppath, size_t tmpsiz, const char *path)
+{
+	const char *base;
+	int fd, r;
+
+	base = (base = strrchr(path, '/')) ? base + 1 : path;
+	r = snprintf(tmppath, tmpsiz, "%.*s.%s.XXXXXX", (int)(base - path), path, base);
+	if (r < 0 || (size_t)r >= tmpsiz) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((fd = mkstemp(tmppath)) == -1)
+		return -1;
+	if (fchmod(fd, pagemode) == -1) {
+		close(fd);
+		unlink(tmppath);
+		return -1;
+	}
+	return fd;
+}
+
+/* Open an output file for writing, it replaces path in tmpfclose() so a
+   reader or a crash never sees a partial file. */
+FILE *
+tmpfopen(const char *path, char *tmppath, size_t tmpsiz)
+{
+	FILE *fp;
+	int fd;
+
+	if ((fd = mktmpfile(tmppath, tmpsiz, path)) == -1)
+		err(1, "mkstemp: '%s'", path);
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+
+	return fp;
+}
+
+void
+tmpfclose(FILE *fp, const char *tmppath, const char *path)
+{
+	checkfileerror(fp, path, 'w');
+	fclose(fp);
+	if (rename(tmppath, path))
+		err(1, "rename: '%s' to '%s'", tmppath, path);
+}
+
+/* Write a file from a worker thread, errors are reported at the end. */
+int
+writefile(const char *path, const char *buf, size_t len)
+{
+	char tmppath[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	if ((fd = mktmpfile(tmppath, sizeof(tmppath), path)) == -1) {
+		warn("mkstemp: '%s'", path);
+		return -1;
+	}
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("write: '%s'", path);
+			close(fd);
+			unlink(tmppath);
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	if (close(fd) == -1) {
+		warn("close: '%s'", path);
+		unlink(tmppath);
+		return -1;
+	}
+	if (rename(tmppath, path) == -1) {
+		warn("rename: '%s' to '%s'", tmppath, path);
+		unlink(tmppath);
+		return -1;
+	}
+	return 0;
+}
+
+void *
+writeworker(void *arg)
+{
+	struct writejob *job;
+	int r;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&writelock);
+		while (!writehead && !writedone)
+			pthread_cond_wait(&writenotempty, &writelock);
+		if (!(job = writehead)) {
+			pthread_mutex_unlock(&writelock);
+			return NULL;
+		}
+		if (!(writehead = job->next))
+			writetail = NULL;
+		pthread_mutex_unlock(&writelock);
+
+		r = writefile(job->path, job->buf, job->len);
+
+		pthread_mutex_lock(&writelock);
+		writequeued -= job->len;
+		if (r)
+			writeerr = 1;
+		pthread_cond_signal(&writenotfull);
+		pthread_mutex_unlock(&writelock);
+		free(job->path);
+		free(job->buf);
+		free(job);
+	}
+}
+
+void
+threadstart(void)
+{
+	long long i;
+
+	if (nwriters > (long long)LEN(writers))
+		nwriters = LEN(writers);
+	for (i = 0; i < nwriters; i++)
+		if (pthread_create(&writers[i], NULL, writeworker, NULL))
+			errx(1, "pthread_create");
+}
+
+void
+threadsubmit(char *path, char *buf, size_t len)
+{
+	struct writejob *job;
+
+	if (!(job = calloc(1, sizeof(*job))))
+		err(1, "calloc");
+	job->path = path;
+	job->buf = buf;
+	job->len = len;
+
+	pthread_mutex_lock(&writelock);
+	/* rendering waits for the writers when too much is queued */
+	while (writequeued && writequeued + len > writemaxqueued)
+		pthread_cond_wait(&writenotfull, &writelock);
+	if (writetail)
+		writetail->next = job;
+	else
+		writehead = job;
+	writetail = job;
+	writequeued += len;
+	pthread_cond_signal(&writenotempty);
+	pthread_mutex_unlock(&writelock);
+}
+
+void
+threadfinish(void)
+{
+	long long i;
+
+	pthread_mutex_lock(&writelock);
+	writedone = 1;
+	pthread_cond_broadcast(&writenotempty);
+	pthread_mutex_unlock(&writelock);
+	for (i = 0; i < nwriters; i++)
+		pthread_join(writers[i], NULL);
+	if (writeerr)
+		errx(1, "write error: pages");
+}
+
+/* writer threads, rendering overlaps with the open, write and close calls */
+static const struct outbackend threadbackend = {
+	"thread", threadstart, threadsubmit, threadfinish
+};
+
+FILE *
+pageopen(const char *path)
+{
+	struct openpage *op;
+	char tmppath[PATH_MAX];
+	size_t i;
+	FILE *fp;
+
+	pthread_mutex_lock(&pagelock);
+	for (i = 0; i < LEN(openpages) && openpages[i].fp; i++)
+		;
+	if (i == LEN(openpages))
+		errx(1, "too many open pages");
+	op = &openpages[i];
+	if (!(op->path = strdup(path)))
+		err(1, "strdup");
+	if (outbackend) {
+		if (!(op->fp = open_memstream(&(op->buf), &(op->len))))
+			err(1, "open_memstream");
+	} else {
+		op->fp = tmpfopen(path, tmppath, sizeof(tmppath));
+		if (!(op->tmppath = strdup(tmppath)))
+			err(1, "strdup");
+	}
+	fp = op->fp;
+	pthread_mutex_unlock(&pagelock);
+
+	return fp;
+}
+
+void
+pageclose(FILE *fp, const char *path)
+{
+	struct openpage *op;
+	size_t i;
+
+	pthread_mutex_lock(&pagelock);
+	for (i = 0; i < LEN(openpages) && openpages[i].fp != fp; i++)
+		;
+	if (i == LEN(openpages))
+		errx(1, "page not open: '%s'", path);
+	pthread_mutex_unlock(&pagelock);
+	/* the slot stays taken until it is cleared */
+	op = &openpages[i];
+	if (!outbackend) {
+		tmpfclose(fp, op->tmppath, op->path);
+		free(op->tmppath);
+		free(op->path);
+	} else {
+		checkfileerror(fp, path, 'w');
+		fclose(fp);
+		outbackend->submit(op->path, op->buf, op->len);
+	}
+	pthread_mutex_lock(&pagelock);
+	memset(op, 0, sizeof(*op));
+	pthread_mutex_unlock(&pagelock);
+}
+
 /* Percent-encode, see RFC3986 section 2.1. */
 void percentencode(FILE *fp, const char *s, size_t len) {
 	static char tab[] = "0123456789ABCDEF";
@@ -391,78 +1260,188 @@ xmlencodeline(FILE *fp, const char *s, size_t len)
 	}
 }
 
+/* Create a directory and its parents. Directories created or found before
+   are kept in a set, so each is only created once per run. */
 int
 mkdirp(const char *path)
 {
 	char tmp[PATH_MAX], *p;
+	int ret = -1;
 
 	if (strlcpy(tmp, path, sizeof(tmp)) >= sizeof(tmp))
 		errx(1, "path truncated: '%s'", path);
+
+	/* the content cache is also written from the Markdown threads */
+	pthread_mutex_lock(&dircachelock);
+	if (pathset_has(&dircache, tmp)) {
+		ret = 0;
+		goto end;
+	}
 	for (p = tmp + (tmp[0] == '/'); *p; p++) {
 		if (*p != '/')
 			continue;
 		*p = '\0';
-		if (mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
-			return -1;
+		if (!pathset_has(&dircache, tmp)) {
+			if (mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
+				goto end;
+			pathset_add(&dircache, tmp);
+		}
 		*p = '/';
 	}
 	if (mkdir(tmp, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
+		goto end;
+	pathset_add(&dircache, tmp);
+	ret = 0;
+end:
+	pthread_mutex_unlock(&dircachelock);
+
+	return ret;
+}
+
+/* Write the directory part of path to buf, "." if it has none. Unlike
+   dirname() it is safe from the renderer threads. */
+int
+parentdir(char *buf, size_t bufsiz, const char *path)
+{
+	char *p;
+
+	if (strlcpy(buf, path, bufsiz) >= bufsiz)
+		return -1;
+	if (!(p = strrchr(buf, '/')))
+		return strlcpy(buf, ".", bufsiz) >= bufsiz ? -1 : 0;
+	/* keep the root of an absolute path */
+	while (p > buf && p[-1] == '/')
+		p--;
+	p[p == buf] = '\0';
+
+	return 0;
+}
+
+/* Create the parent directories of the page fpath and write the relative
+   path from it to the top of the output directory to rel. */
+int
+mkpagedir(const char *fpath, char *rel, size_t relsiz)
+{
+	char tmp[PATH_MAX];
+	const char *p;
+
+	if (parentdir(tmp, sizeof(tmp), fpath))
+		errx(1, "path truncated: '%s'", fpath);
+	if (mkdirp(tmp))
 		return -1;
+
+	for (p = fpath, rel[0] = '\0'; *p; p++) {
+		if (*p == '/' && strlcat(rel, "../", relsiz) >= relsiz)
+			errx(1, "path truncated: '../%s'", rel);
+	}
+
 	return 0;
 }
 
+const struct dayfmt *
+getdayfmt(struct renderctx *ctx, long long t, int *sec)
+{
+	struct dayfmt *d;
+	struct tm intm;
+	long long day;
+	time_t dt;
+
+	day = t / 86400;
+	if ((*sec = t % 86400) < 0) {
+		*sec += 86400;
+		day--;
+	}
+	d = &ctx->dayfmts[day & (LEN(ctx->dayfmts) - 1)];
+	if (!d->valid || d->day != day) {
+		dt = (time_t)(day * 86400);
+		if (!gmtime_r(&dt, &intm))
+			return NULL;
+		strftime(d->ymd, sizeof(d->ymd), "%Y-%m-%d", &intm);
+		strftime(d->full, sizeof(d->full), "%a, %e %b %Y", &intm);
+		d->day = day;
+		d->valid = 1;
+	}
+	return d;
+}
+
+/* write "HH:MM:SS" for the seconds of a day to buf */
+char *
+fmthms(char *buf, int sec)
+{
+	buf[0] = '0' + sec / 36000;
+	buf[1] = '0' + sec / 3600 % 10;
+	buf[2] = ':';
+	buf[3] = '0' + sec / 600 % 6;
+	buf[4] = '0' + sec / 60 % 10;
+	buf[5] = ':';
+	buf[6] = '0' + sec % 60 / 10;
+	buf[7] = '0' + sec % 10;
+	return buf + 8;
+}
+
 void
-printtimez(FILE *fp, const git_time *intime)
+printtimez(struct renderctx *ctx, FILE *fp, const git_time *intime)
 {
-	struct tm *intm;
-	time_t t;
-	char out[32];
+	const struct dayfmt *d;
+	char out[32], *p;
+	size_t len;
+	int sec;
 
-	t = (time_t)intime->time;
-	if (!(intm = gmtime(&t)))
+	if (!(d = getdayfmt(ctx, intime->time, &sec)))
 		return;
-	strftime(out, sizeof(out), "%Y-%m-%dT%H:%M:%SZ", intm);
-	fputs(out, fp);
+	len = strlen(d->ymd);
+	memcpy(out, d->ymd, len);
+	p = out + len;
+	*p++ = 'T';
+	p = fmthms(p, sec);
+	*p++ = 'Z';
+	fwrite(out, 1, p - out, fp);
 }
 
 void
-printtime(FILE *fp, const git_time *intime)
+printtime(struct renderctx *ctx, FILE *fp, const git_time *intime)
 {
-	struct tm *intm;
-	time_t t;
-	char out[32];
+	const struct dayfmt *d;
+	char out[64], *p;
+	size_t len;
+	int sec, off;
 
-	t = (time_t)intime->time + (intime->offset * 60);
-	if (!(intm = gmtime(&t)))
+	if (!(d = getdayfmt(ctx, intime->time + (intime->offset * 60), &sec)))
 		return;
-	strftime(out, sizeof(out), "%a, %e %b %Y %H:%M:%S", intm);
-	if (intime->offset < 0)
-		fprintf(fp, "%s -%02d%02d", out,
-		            -(intime->offset) / 60, -(intime->offset) % 60);
-	else
-		fprintf(fp, "%s +%02d%02d", out,
-		            intime->offset / 60, intime->offset % 60);
+	len = strlen(d->full);
+	memcpy(out, d->full, len);
+	p = out + len;
+	*p++ = ' ';
+	p = fmthms(p, sec);
+	*p++ = ' ';
+	*p++ = intime->offset < 0 ? '-' : '+';
+	off = intime->offset < 0 ? -(intime->offset) : intime->offset;
+	if (off / 60 < 100) {
+		*p++ = '0' + off / 600;
+		*p++ = '0' + off / 60 % 10;
+		*p++ = '0' + off % 60 / 10;
+		*p++ = '0' + off % 10;
+		fwrite(out, 1, p - out, fp);
+	} else {
+		fwrite(out, 1, p - out, fp);
+		fprintf(fp, "%02d%02d", off / 60, off % 60);
+	}
 }
 
 void
-printtimeshort(FILE *fp, const git_time *intime)
+printtimeshort(struct renderctx *ctx, FILE *fp, const git_time *intime)
 {
-	struct tm *intm;
-	time_t t;
-	char out[32];
+	const struct dayfmt *d;
+	int sec;
 
-	t = (time_t)intime->time;
-	if (!(intm = gmtime(&t)))
+	if (!(d = getdayfmt(ctx, intime->time, &sec)))
 		return;
-	strftime(out, sizeof(out), "%Y-%m-%d", intm);
-	fputs(out, fp);
+	fputs(d->ymd, fp);
 }
 
-void writeheader(FILE *fp, const char *title) {
-	fputs("<!DOCTYPE html>\n<meta charset=\"UTF-8\">\n<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">\n<title>", fp);
-	xmlencode(fp, title, strlen(title));
-	if (title[0] && strippedname[0])
-		fputs(" - ", fp);
+/* The part of the page header after the title, it only depends on the
+   repository and relpath. */
+void writeheadertail(FILE *fp, const char *relpath) {
 	xmlencode(fp, strippedname, strlen(strippedname));
 	if (description[0])
 		fputs(" - ", fp);
@@ -502,30 +1481,435 @@ void writeheader(FILE *fp, const char *title) {
 		fprintf(fp, " | <a href=\"%sREADME.html\">README</a>", relpath);
 	if (license)
 		fprintf(fp, " | <a href=\"%sfile/%s.html\">LICENSE</a>", relpath, license);
+	if (searchindex)
+		fprintf(fp, " | <a href=\"%ssearch.html\">Search</a>", relpath);
 
 	fputs("</td></tr>\n\t</table>\n</div>\n<br>\n", fp);
 }
 
+void writeheader(FILE *fp, const char *relpath, const char *title) {
+	static const char head[] = "<!DOCTYPE html>\n<meta charset=\"UTF-8\">\n<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">\n<title>";
+	struct fragment *f;
+	FILE *mfp;
+	char *data;
+	size_t depth, len;
+
+	fwrite(head, 1, sizeof(head) - 1, fp);
+	xmlencode(fp, title, strlen(title));
+	if (title[0] && strippedname[0])
+		fputs(" - ", fp);
+
+	/* relpath is always zero or more "../" */
+	depth = strlen(relpath) / 3;
+	pthread_mutex_lock(&headerlock);
+	if (depth >= nheadertails) {
+		if (!(headertails = reallocarray(headertails, depth + 1, sizeof(*headertails))))
+			err(1, "realloc");
+		memset(&headertails[nheadertails], 0,
+		       (depth + 1 - nheadertails) * sizeof(*headertails));
+		nheadertails = depth + 1;
+	}
+	f = &headertails[depth];
+	if (!f->data) {
+		if (!(mfp = open_memstream(&(f->data), &(f->len))))
+			err(1, "open_memstream");
+		writeheadertail(mfp, relpath);
+		checkfileerror(mfp, "header", 'w');
+		fclose(mfp);
+	}
+	data = f->data;
+	len = f->len;
+	pthread_mutex_unlock(&headerlock);
+	fwrite(data, 1, len, fp);
+}
+
 void writefooter(FILE *fp) {
-	fputs("</div>\n</table>\n</div>\n<div id=\"footer\">\n"
+	static const char footer[] = "</div>\n</table>\n</div>\n<div id=\"footer\">\n"
 		"\t&copy; 2023 acidvegas, inc &bull; generated with stagit\n"
-		"</div>\n</center>", fp);
+		"</div>\n</center>";
+
+	fwrite(footer, 1, sizeof(footer) - 1, fp);
+}
+
+void printlineno(FILE *fp, size_t n) {
+	if (compact)
+		fprintf(fp, "<i id=\"l%zu\"></i>", n);
+	else
+		fprintf(fp, "<a href=\"#l%zu\" class=\"line\" id=\"l%zu\">%7zu</a> ", n, n, n);
+}
+
+size_t
+countlines(const char *s, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++)
+		if (s[i] == '\n')
+			n++;
+	/* trailing data */
+	if (len && s[len - 1] != '\n')
+		n++;
+	return n;
+}
+
+/* Path of the content cache file for the blob id with extension ext, the
+   first two hex digits are used as a subdirectory as in the git odb. */
+int
+contentcachepath(char *buf, size_t bufsiz, const git_oid *id, const char *ext)
+{
+	char oid[GIT_OID_HEXSZ + 1];
+	int r;
+
+	git_oid_tostr(oid, sizeof(oid), id);
+	r = snprintf(buf, bufsiz, "%s/%.2s/%s%s", contentcache, oid, oid + 2, ext);
+	if (r < 0 || (size_t)r >= bufsiz)
+		return -1;
+	return 0;
+}
+
+int
+readcontentcache(const git_oid *id, const char *ext, char **buf, size_t *len)
+{
+	FILE *fp;
+	char path[PATH_MAX];
+	struct stat st;
+	int ret = -1;
+
+	if (!contentcache || contentcachepath(path, sizeof(path), id, ext) ||
+	    !(fp = fopen(path, "r")))
+		return -1;
+	if (fstat(fileno(fp), &st) == -1)
+		goto end;
+	*len = st.st_size;
+	if (!(*buf = malloc(*len + 1)))
+		err(1, "malloc");
+	if (fread(*buf, 1, *len, fp) == *len) {
+		ret = 0;
+	} else {
+		free(*buf);
+		*buf = NULL;
+	}
+end:
+	fclose(fp);
+
+	return ret;
+}
+
+/* Store content in the cache, failures only lose the cached copy. The file
+   is written under a temporary name and renamed so concurrent runs sharing
+   the cache never read a partial file. */
+void
+writecontentcache(const git_oid *id, const char *ext, const char *buf, size_t len)
+{
+	FILE *fp;
+	char path[PATH_MAX], tmppath[PATH_MAX];
+	int fd, r;
+
+	if (!contentcache || contentcachepath(path, sizeof(path), id, ext))
+		return;
+	if (parentdir(tmppath, sizeof(tmppath), path) || mkdirp(tmppath))
+		return;
+	r = snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path);
+	if (r < 0 || (size_t)r >= sizeof(tmppath))
+		return;
+	if ((fd = mkstemp(tmppath)) == -1) {
+		warn("mkstemp: '%s'", tmppath);
+		return;
+	}
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	if (fwrite(buf, 1, len, fp) != len || fflush(fp) || ferror(fp)) {
+		warnx("write error: %s", tmppath);
+		fclose(fp);
+		unlink(tmppath);
+		return;
+	}
+	fclose(fp);
+	if (rename(tmppath, path)) {
+		warn("rename: '%s' to '%s'", tmppath, path);
+		unlink(tmppath);
+	}
+}
+
+/* highlighter classes, the CSS class of the span is hlclass[class] */
+enum { HL_NONE, HL_COMMENT, HL_STRING, HL_KEYWORD, HL_NUMBER, HL_PREPROC };
+static const char *hlclass[] = { "", "c", "s", "k", "n", "p" };
+
+static const char *const kw_c[] = {
+	"auto", "bool", "break", "case", "char", "class", "const",
+	"continue", "default", "delete", "do", "double", "else", "enum",
+	"extern", "false", "float", "for", "goto", "if", "inline", "int",
+	"long", "namespace", "new", "nullptr", "private", "protected",
+	"public", "register", "restrict", "return", "short", "signed",
+	"sizeof", "static", "struct", "switch", "template", "this", "true",
+	"typedef", "union", "unsigned", "virtual", "void", "volatile",
+	"while"
+};
+
+static const char *const kw_go[] = {
+	"break", "case", "chan", "const", "continue", "default", "defer",
+	"else", "fallthrough", "false", "for", "func", "go", "goto", "if",
+	"import", "interface", "map", "nil", "package", "range", "return",
+	"select", "struct", "switch", "true", "type", "var"
+};
+
+static const char *const kw_js[] = {
+	"async", "await", "break", "case", "catch", "class", "const",
+	"continue", "debugger", "default", "delete", "do", "else", "export",
+	"extends", "false", "finally", "for", "function", "if", "import",
+	"in", "instanceof", "let", "new", "null", "of", "return", "super",
+	"switch", "this", "throw", "true", "try", "typeof", "undefined",
+	"var", "void", "while", "with", "yield"
+};
+
+static const char *const kw_lua[] = {
+	"and", "break", "do", "else", "elseif", "end", "false", "for",
+	"function", "goto", "if", "in", "local", "nil", "not", "or",
+	"repeat", "return", "then", "true", "until", "while"
+};
+
+static const char *const kw_py[] = {
+	"False", "None", "True", "and", "as", "assert", "async", "await",
+	"break", "class", "continue", "def", "del", "elif", "else", "except",
+	"finally", "for", "from", "global", "if", "import", "in", "is",
+	"lambda", "nonlocal", "not", "or", "pass", "raise", "return", "try",
+	"while", "with", "yield"
+};
+
+static const char *const kw_rs[] = {
+	"Self", "as", "break", "const", "continue", "crate", "else", "enum",
+	"extern", "false", "fn", "for", "if", "impl", "in", "let", "loop",
+	"match", "mod", "move", "mut", "pub", "ref", "return", "self",
+	"static", "struct", "super", "trait", "true", "type", "unsafe",
+	"use", "where", "while"
+};
+
+static const char *const kw_sh[] = {
+	"case", "do", "done", "elif", "else", "esac", "export", "fi", "for",
+	"function", "if", "in", "local", "read", "return", "set", "shift",
+	"then", "unset", "until", "while"
+};
+
+static const struct lang langs[] = {
+	{ "c", ".c .h .cc .cpp .cxx .hh .hpp", "//", "/*", "*/", "\"'", 1, 0, kw_c, LEN(kw_c) },
+	{ "go", ".go", "//", "/*", "*/", "\"'`", 0, 0, kw_go, LEN(kw_go) },
+	{ "js", ".js .mjs .ts", "//", "/*", "*/", "\"'`", 0, 0, kw_js, LEN(kw_js) },
+	{ "lua", ".lua", "--", "--[[", "]]", "\"'", 0, 0, kw_lua, LEN(kw_lua) },
+	{ "py", ".py", "#", NULL, NULL, "\"'", 0, 0, kw_py, LEN(kw_py) },
+	{ "rs", ".rs", "//", "/*", "*/", "\"", 0, 0, kw_rs, LEN(kw_rs) },
+	{ "sh", ".sh .bash .ksh", "#", NULL, NULL, "\"'", 0, 1, kw_sh, LEN(kw_sh) },
+};
+
+int
+kwcmp(const void *key, const void *kw)
+{
+	return strcmp(key, *(const char *const *)kw);
+}
+
+const struct lang *
+findlang(const char *filename)
+{
+	const char *e, *end;
+	size_t i, n, len = strlen(filename);
+
+	for (i = 0; i < LEN(langs); i++) {
+		for (e = langs[i].exts; *e; e = *end ? end + 1 : end) {
+			if (!(end = strchr(e, ' ')))
+				end = e + strlen(e);
+			n = end - e;
+			if (len > n && !strncasecmp(filename + len - n, e, n))
+				return &langs[i];
+		}
+	}
+	return NULL;
+}
+
+int
+isidentc(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	       (c >= '0' && c <= '9') || c == '_' || c >= 0x80;
+}
+
+int
+hasprefix(const char *s, size_t len, const char *prefix)
+{
+	size_t n = strlen(prefix);
+
+	return n <= len && !memcmp(s, prefix, n);
+}
+
+/* Set the class of each byte of s. Strings and line comments end at the end
+   of the line, block comments may span lines. */
+void
+hllex(const struct lang *l, const char *s, size_t len, unsigned char *cls)
+{
+	char word[32];
+	size_t i = 0, j;
+	int bol = 1, c;
+
+	while (i < len) {
+		c = (unsigned char)s[i];
+		if (c == '\n') {
+			cls[i++] = HL_NONE;
+			bol = 1;
+			continue;
+		}
+		if (bol && (c == ' ' || c == '\t')) {
+			cls[i++] = HL_NONE;
+			continue;
+		}
+		if (bol && l->preproc && c == '#') {
+			/* lines continued with a backslash are part of it */
+			for (j = i; j < len && (s[j] != '\n' || (j > i && s[j - 1] == '\\')); j++)
+				;
+		} else if (l->blockstart && hasprefix(s + i, len - i, l->blockstart)) {
+			for (j = i + strlen(l->blockstart); j < len; j++) {
+				if (hasprefix(s + j, len - j, l->blockend)) {
+					j += strlen(l->blockend);
+					break;
+				}
+			}
+			memset(cls + i, HL_COMMENT, j - i);
+			i = j;
+			bol = 0;
+			continue;
+		} else if (l->linecomment && hasprefix(s + i, len - i, l->linecomment) &&
+		           (!l->wordcomment || bol || s[i - 1] == ' ' || s[i - 1] == '\t')) {
+			for (j = i; j < len && s[j] != '\n'; j++)
+				;
+			memset(cls + i, HL_COMMENT, j - i);
+			i = j;
+			continue;
+		} else if (strchr(l->quotes, c) && c) {
+			for (j = i + 1; j < len && s[j] != c && s[j] != '\n'; j++)
+				if (s[j] == '\\' && j + 1 < len && s[j + 1] != '\n')
+					j++;
+			if (j < len && s[j] == c)
+				j++;
+			memset(cls + i, HL_STRING, j - i);
+			i = j;
+			bol = 0;
+			continue;
+		} else if (c >= '0' && c <= '9') {
+			for (j = i; j < len && (isidentc(s[j]) || s[j] == '.'); j++)
+				;
+			memset(cls + i, HL_NUMBER, j - i);
+			i = j;
+			bol = 0;
+			continue;
+		} else if (isidentc(c)) {
+			for (j = i; j < len && isidentc(s[j]); j++)
+				;
+			c = HL_NONE;
+			if (j - i < sizeof(word)) {
+				memcpy(word, s + i, j - i);
+				word[j - i] = '\0';
+				if (bsearch(word, l->keywords, l->nkeywords, sizeof(*l->keywords), kwcmp))
+					c = HL_KEYWORD;
+			}
+			memset(cls + i, c, j - i);
+			i = j;
+			bol = 0;
+			continue;
+		} else {
+			cls[i++] = HL_NONE;
+			bol = 0;
+			continue;
+		}
+		/* preprocessor line */
+		memset(cls + i, HL_PREPROC, j - i);
+		i = j;
+	}
+}
+
+/* Write the numbered lines of s with a span for each run of a class, spans
+   are closed at the end of each line. */
+void
+writehllines(FILE *fp, const char *s, size_t len, const unsigned char *cls)
+{
+	size_t i, j, n = 0, prev;
+
+	for (i = 0, prev = 0; i <= len; i++) {
+		if (i < len && s[i] != '\n')
+			continue;
+		if (i == len && prev == len)
+			break;
+		printlineno(fp, ++n);
+		for (j = prev; j < i; j = prev) {
+			for (prev = j; prev < i && cls[prev] == cls[j]; prev++)
+				;
+			if (cls[j] != HL_NONE)
+				fprintf(fp, "<span class=\"%s\">", hlclass[cls[j]]);
+			xmlencodeline(fp, s + j, prev - j);
+			if (cls[j] != HL_NONE)
+				fputs("</span>", fp);
+		}
+		if (i < len)
+			putc('\n', fp);
+		prev = i + 1;
+	}
+}
+
+/* Write the highlighted lines of a blob, from the content cache when it was
+   highlighted before. */
+void
+writehighlight(struct renderctx *ctx, FILE *fp, const git_blob *blob,
+               const struct lang *l)
+{
+	const char *s = git_blob_rawcontent(blob);
+	size_t len = git_blob_rawsize(blob), buflen = 0;
+	unsigned char *cls;
+	char ext[32], *buf = NULL;
+	long long start;
+	FILE *mfp;
+
+	snprintf(ext, sizeof(ext), ".%s%d-%s", compact ? "hlc" : "hl", HL_VERSION, l->name);
+	if (!readcontentcache(git_blob_id(blob), ext, &buf, &buflen)) {
+		fwrite(buf, 1, buflen, fp);
+		free(buf);
+		ctx->hlcached++;
+		return;
+	}
+
+	start = nowus();
+	if (!(cls = malloc(len)))
+		err(1, "malloc");
+	hllex(l, s, len, cls);
+	if (!(mfp = open_memstream(&buf, &buflen)))
+		err(1, "open_memstream");
+	writehllines(mfp, s, len, cls);
+	checkfileerror(mfp, "highlight", 'w');
+	fclose(mfp);
+	free(cls);
+	ctx->hltime += nowus() - start;
+	ctx->hlfiles++;
+
+	fwrite(buf, 1, buflen, fp);
+	writecontentcache(git_blob_id(blob), ext, buf, buflen);
+	free(buf);
 }
 
-size_t writeblobhtml(FILE *fp, const git_blob *blob) {
+size_t writeblobhtml(struct renderctx *ctx, FILE *fp, const git_blob *blob, const char *filename) {
 	size_t n = 0, i, len, prev;
-	const char *nfmt = "<a href=\"#l%zu\" class=\"line\" id=\"l%zu\">%7zu</a> ";
 	const char *s = git_blob_rawcontent(blob);
+	const struct lang *l;
 
 	len = git_blob_rawsize(blob);
-	fputs("<pre id=\"blob\">\n", fp);
+	if (compact)
+		fprintf(fp, "<pre id=\"blob\" class=\"compact\"%s>\n", compactclick);
+	else
+		fputs("<pre id=\"blob\">\n", fp);
 
-	if (len > 0) {
+	if (len > 0 && syntax && (l = findlang(filename))) {
+		writehighlight(ctx, fp, blob, l);
+		n = countlines(s, len);
+	} else if (len > 0) {
 		for (i = 0, prev = 0; i < len; i++) {
 			if (s[i] != '\n')
 				continue;
 			n++;
-			fprintf(fp, nfmt, n, n, n);
+			printlineno(fp, n);
 			xmlencodeline(fp, &s[prev], i - prev + 1);
 			putc('\n', fp);
 			prev = i + 1;
@@ -533,7 +1917,7 @@ size_t writeblobhtml(FILE *fp, const git_blob *blob) {
 		/* trailing data */
 		if ((len - prev) > 0) {
 			n++;
-			fprintf(fp, nfmt, n, n, n);
+			printlineno(fp, n);
 			xmlencodeline(fp, &s[prev], len - prev);
 		}
 	}
@@ -543,10 +1927,10 @@ size_t writeblobhtml(FILE *fp, const git_blob *blob) {
 	return n;
 }
 
-void printcommit(FILE *fp, struct commitinfo *ci) {
-	fprintf(fp, "<b>commit</b> <a href=\"%scommit/%s.html\">%s</a>\n", relpath, ci->oid, ci->oid);
+void printcommit(struct renderctx *ctx, FILE *fp, struct commitinfo *ci) {
+	fprintf(fp, "<b>commit</b> <a href=\"%scommit/%s.html\">%s</a>\n", ctx->relpath, ci->oid, ci->oid);
 	if (ci->parentoid[0])
-		fprintf(fp, "<br><b>parent</b> <a href=\"%scommit/%s.html\">%s</a>\n", relpath, ci->parentoid, ci->parentoid);
+		fprintf(fp, "<br><b>parent</b> <a href=\"%scommit/%s.html\">%s</a>\n", ctx->relpath, ci->parentoid, ci->parentoid);
 	if (ci->author) {
 		fputs("<br><b>Author:</b> ", fp);
 		xmlencode(fp, ci->author->name, strlen(ci->author->name));
@@ -555,7 +1939,7 @@ void printcommit(FILE *fp, struct commitinfo *ci) {
 		fputs("\">", fp);
 		xmlencode(fp, ci->author->email, strlen(ci->author->email));
 		fputs("</a>&gt;\n<br><b>Date:</b>   ", fp);
-		printtime(fp, &(ci->author->when));
+		printtime(ctx, fp, &(ci->author->when));
 		putc('\n', fp);
 	}
 	if (ci->msg) {
@@ -567,33 +1951,80 @@ void printcommit(FILE *fp, struct commitinfo *ci) {
 }
 
 void
-printshowfile(FILE *fp, struct commitinfo *ci)
+printfilediff(struct renderctx *ctx, FILE *fp, size_t i, git_patch *patch)
 {
 	const git_diff_delta *delta;
 	const git_diff_hunk *hunk;
 	const git_diff_line *line;
-	git_patch *patch;
-	size_t nhunks, nhunklines, changed, add, del, total, i, j, k;
+	size_t nhunks, nhunklines, j, k;
+
+	delta = git_patch_get_delta(patch);
+	fprintf(fp, "<tr><td><pre%s><b>diff --git a/<a id=\"h%zu\" href=\"%sfile/",
+	        compact ? compactclick : "", i, ctx->relpath);
+	percentencode(fp, delta->old_file.path, strlen(delta->old_file.path));
+	fputs(".html\">", fp);
+	xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
+	fprintf(fp, "</a> b/<a href=\"%sfile/", ctx->relpath);
+	percentencode(fp, delta->new_file.path, strlen(delta->new_file.path));
+	fprintf(fp, ".html\">");
+	xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
+	fprintf(fp, "</a></b>\n");
+
+	/* check binary data */
+	if (delta->flags & GIT_DIFF_FLAG_BINARY) {
+		fputs("Binary files differ.\n", fp);
+		return;
+	}
+
+	nhunks = git_patch_num_hunks(patch);
+	for (j = 0; j < nhunks; j++) {
+		if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
+			break;
+
+		fprintf(fp, "<a href=\"#h%zu-%zu\" id=\"h%zu-%zu\" class=\"h\">", i, j, i, j);
+		xmlencode(fp, hunk->header, hunk->header_len);
+		fputs("</a>", fp);
+
+		for (k = 0; ; k++) {
+			if (git_patch_get_line_in_hunk(&line, patch, j, k))
+				break;
+			if (compact && line->old_lineno == -1)
+				fprintf(fp, "<i id=\"h%zu-%zu-%zu\" class=\"i\">+", i, j, k);
+			else if (compact && line->new_lineno == -1)
+				fprintf(fp, "<i id=\"h%zu-%zu-%zu\" class=\"d\">-", i, j, k);
+			else if (line->old_lineno == -1)
+				fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"i\">+",
+					i, j, k, i, j, k);
+			else if (line->new_lineno == -1)
+				fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"d\">-",
+					i, j, k, i, j, k);
+			else
+				putc(' ', fp);
+			xmlencodeline(fp, line->content, line->content_len);
+			putc('\n', fp);
+			if (line->old_lineno == -1 || line->new_lineno == -1)
+				fputs(compact ? "</i>" : "</a>", fp);
+		}
+	}
+}
+
+void
+printshowfile(struct renderctx *ctx, FILE *fp, struct commitinfo *ci)
+{
+	const git_diff_delta *delta;
+	size_t changed, add, del, total, i;
 	char linestr[80];
 	int c;
 
-	printcommit(fp, ci);
+	printcommit(ctx, fp, ci);
 
 	if (!ci->deltas)
 		return;
 
-	if (ci->filecount > 1000   ||
-	    ci->ndeltas   > 1000   ||
-	    ci->addcount  > 100000 ||
-	    ci->delcount  > 100000) {
-		fputs("Diff is too large, output suppressed.\n", fp);
-		return;
-	}
-
 	/* diff stat */
 	fputs("<br><br><b>Diffstat:</b>\n<table>", fp);
 	for (i = 0; i < ci->ndeltas; i++) {
-		delta = git_patch_get_delta(ci->deltas[i]->patch);
+		delta = git_diff_get_delta(ci->diff, i);
 
 		switch (delta->status) {
 		case GIT_DELTA_ADDED:      c = 'A'; break;
@@ -609,7 +2040,13 @@ printshowfile(FILE *fp, struct commitinfo *ci)
 		else
 			fprintf(fp, "<tr><td class=\"%c\">%c", c, c);
 
-		fprintf(fp, "</td><td><a href=\"#h%zu\">", i);
+		/* a split commit links to the diff page of each file */
+		if (!ci->split)
+			fprintf(fp, "</td><td><a href=\"#h%zu\">", i);
+		else if (i < SPLIT_MAXFILES)
+			fprintf(fp, "</td><td><a href=\"%s/%zu.html\">", ci->oid, i);
+		else
+			fputs("</td><td><a>", fp);
 		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
 		if (strcmp(delta->old_file.path, delta->new_file.path)) {
 			fputs(" -&gt; ", fp);
@@ -641,306 +2078,2758 @@ printshowfile(FILE *fp, struct commitinfo *ci)
 	        ci->addcount,  ci->addcount  == 1 ? "" : "s",
 	        ci->delcount,  ci->delcount  == 1 ? "" : "s");
 
-	for (i = 0; i < ci->ndeltas; i++) {
-		patch = ci->deltas[i]->patch;
-		delta = git_patch_get_delta(patch);
-		fprintf(fp, "<tr><td><pre><b>diff --git a/<a id=\"h%zu\" href=\"%sfile/", i, relpath);
-		percentencode(fp, delta->old_file.path, strlen(delta->old_file.path));
-		fputs(".html\">", fp);
-		xmlencode(fp, delta->old_file.path, strlen(delta->old_file.path));
-		fprintf(fp, "</a> b/<a href=\"%sfile/", relpath);
-		percentencode(fp, delta->new_file.path, strlen(delta->new_file.path));
-		fprintf(fp, ".html\">");
-		xmlencode(fp, delta->new_file.path, strlen(delta->new_file.path));
-		fprintf(fp, "</a></b>\n");
+	if (ci->nofind == FIND_SKIP_DELTAS)
+		fprintf(fp, "<tr><td><pre>No rename or copy detection: more than %lld changed files.\n</pre></td></tr>\n",
+		        findmaxdeltas);
+	else if (ci->nofind == FIND_SKIP_TIME)
+		fprintf(fp, "<tr><td><pre>No rename or copy detection: it does not fit in the time budget of %lldms.\n</pre></td></tr>\n",
+		        findbudget);
+
+	if (ci->split) {
+		fputs("<tr><td><pre>Diff is too large for one page, "
+		      "see the diff of each file in the diffstat.\n", fp);
+		if (ci->ndeltas > SPLIT_MAXFILES)
+			fprintf(fp, "Only the first %d files have a diff page.\n",
+			        SPLIT_MAXFILES);
+		return;
+	}
 
-		/* check binary data */
-		if (delta->flags & GIT_DIFF_FLAG_BINARY) {
-			fputs("Binary files differ.\n", fp);
-			continue;
-		}
+	for (i = 0; i < ci->ndeltas; i++)
+		printfilediff(ctx, fp, i, ci->deltas[i]->patch);
+}
 
-		nhunks = git_patch_num_hunks(patch);
-		for (j = 0; j < nhunks; j++) {
-			if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
-				break;
+/* Write the diff of each file of a split commit to its own page
+   commit/<oid>/<n>.html, one patch in memory at a time. */
+void
+writesplitcommit(struct renderctx *ctx, struct commitinfo *ci)
+{
+	git_patch *patch;
+	const char *rel = ctx->relpath;
+	char path[PATH_MAX];
+	size_t i, n;
+	long long start = nowms();
+	FILE *fp;
+	int r;
 
-			fprintf(fp, "<a href=\"#h%zu-%zu\" id=\"h%zu-%zu\" class=\"h\">", i, j, i, j);
-			xmlencode(fp, hunk->header, hunk->header_len);
-			fputs("</a>", fp);
+	r = snprintf(path, sizeof(path), "commit/%s", ci->oid);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: 'commit/%s'", ci->oid);
+	if (mkdir(path, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
+		err(1, "mkdir: '%s'", path);
 
-			for (k = 0; ; k++) {
-				if (git_patch_get_line_in_hunk(&line, patch, j, k))
-					break;
-				if (line->old_lineno == -1)
-					fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"i\">+",
-						i, j, k, i, j, k);
-				else if (line->new_lineno == -1)
-					fprintf(fp, "<a href=\"#h%zu-%zu-%zu\" id=\"h%zu-%zu-%zu\" class=\"d\">-",
-						i, j, k, i, j, k);
-				else
-					putc(' ', fp);
-				xmlencodeline(fp, line->content, line->content_len);
-				putc('\n', fp);
-				if (line->old_lineno == -1 || line->new_lineno == -1)
-					fputs("</a>", fp);
-			}
+	ctx->relpath = "../../";
+	n = ci->ndeltas < SPLIT_MAXFILES ? ci->ndeltas : SPLIT_MAXFILES;
+	for (i = 0; i < n; i++) {
+		r = snprintf(path, sizeof(path), "commit/%s/%zu.html", ci->oid, i);
+		if (r < 0 || (size_t)r >= sizeof(path))
+			errx(1, "path truncated: 'commit/%s/%zu.html'", ci->oid, i);
+
+		fp = pageopen(path);
+		writeheader(fp, ctx->relpath, ci->summary);
+		fprintf(fp, "<div class=\"container\"><table id=\"container\"><tr><td class=\"border-bottom\">"
+		        "<b>commit</b> <a href=\"../%s.html\">%s</a>, file %zu of %zu<br><br></td></tr>\n",
+		        ci->oid, ci->oid, i + 1, ci->ndeltas);
+		if (ci->deltas[i]->addcount + ci->deltas[i]->delcount > splitmaxlines) {
+			fputs("<tr><td><pre>Diff is too large, output suppressed.\n", fp);
+		} else if (nowms() - start > SPLIT_MAXTIME) {
+			fprintf(fp, "<tr><td><pre>Diff not written, the diff pages of "
+			        "this commit took more than %ds.\n", SPLIT_MAXTIME / 1000);
+		} else if (!git_patch_from_diff(&patch, ci->diff, i)) {
+			printfilediff(ctx, fp, i, patch);
+			git_patch_free(patch);
 		}
+		fputs("</pre></td></tr></table></div>\n", fp);
+		writefooter(fp);
+		pageclose(fp, path);
 	}
+	ctx->relpath = rel;
 }
 
 void
-writelogline(FILE *fp, struct commitinfo *ci)
+printcommitatom(struct renderctx *ctx, FILE *fp, struct commitinfo *ci, const char *tag)
 {
-	fputs("<tr><td>", fp);
-	if (ci->author)
-		printtimeshort(fp, &(ci->author->when));
-	fputs("</td><td>", fp);
+	fputs("<entry>\n", fp);
+
+	fprintf(fp, "<id>%s</id>\n", ci->oid);
+	if (ci->author) {
+		fputs("<published>", fp);
+		printtimez(ctx, fp, &(ci->author->when));
+		fputs("</published>\n", fp);
+	}
+	if (ci->committer) {
+		fputs("<updated>", fp);
+		printtimez(ctx, fp, &(ci->committer->when));
+		fputs("</updated>\n", fp);
+	}
 	if (ci->summary) {
-		fprintf(fp, "<a href=\"%scommit/%s.html\">", relpath, ci->oid);
+		fputs("<title>", fp);
+		if (tag && tag[0]) {
+			fputs("[", fp);
+			xmlencode(fp, tag, strlen(tag));
+			fputs("] ", fp);
+		}
 		xmlencode(fp, ci->summary, strlen(ci->summary));
-		fputs("</a>", fp);
+		fputs("</title>\n", fp);
 	}
-	fputs("</td>", fp);
-	//if (ci->author)
-	//	xmlencode(fp, ci->author->name, strlen(ci->author->name));
-	fputs("<td class=\"num\">", fp);
-	fprintf(fp, "%zu", ci->filecount);
-	fputs("</td><td class=\"num\">", fp);
-	fprintf(fp, "+%zu", ci->addcount);
-	fputs("</td><td class=\"num\">", fp);
-	fprintf(fp, "-%zu", ci->delcount);
-	fputs("</td></tr>\n", fp);
-}
+	fprintf(fp, "<link rel=\"alternate\" type=\"text/html\" href=\"%scommit/%s.html\" />\n",
+	        baseurl, ci->oid);
 
-int
-writelog(FILE *fp, const git_oid *oid)
-{
-	struct commitinfo *ci;
-	git_revwalk *w = NULL;
-	git_oid id;
-	char path[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1];
-	FILE *fpfile;
-	size_t remcommits = 0;
+	if (ci-> author) {
+		fputs("<author>\n<name>", fp);
+		xmlencode(fp, ci->author->name, strlen(ci->author->name));
+		fputs("</name>\n<email>", fp);
+		xmlencode(fp, ci->author->email, strlen(ci->author->email));
+		fputs("</email>\n</author>\n", fp);
+	}
+
+	fputs("<content>", fp);
+	fprintf(fp, "commit %s\n", ci->oid);
+	if (ci->parentoid[0])
+		fprintf(fp, "parent %s\n", ci->parentoid);
+	if (ci->author) {
+		fputs("Author: ", fp);
+		xmlencode(fp, ci->author->name, strlen(ci->author->name));
+		fputs(" &lt;", fp);
+		xmlencode(fp, ci->author->email, strlen(ci->author->email));
+		fputs("&gt;\nDate:   ", fp);
+		printtime(ctx, fp, &(ci->author->when));
+		putc('\n', fp);
+	}
+	if (ci->msg) {
+		putc('\n', fp);
+		xmlencode(fp, ci->msg, strlen(ci->msg));
+	}
+	fputs("\n</content>\n</entry>\n", fp);
+}
+
+void
+writeatomheader(FILE *fp)
+{
+	fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	      "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n<title>", fp);
+	xmlencode(fp, strippedname, strlen(strippedname));
+	fputs(", branch HEAD</title>\n<subtitle>", fp);
+	xmlencode(fp, description, strlen(description));
+	fputs("</subtitle>\n", fp);
+}
+
+void
+writeatomfooter(FILE *fp)
+{
+	fputs("</feed>\n", fp);
+}
+
+/* Atom feed entries of the tags, the commit feed is written by writelog() */
+void
+writeatomtags(FILE *fp, const struct referenceinfo *ris, size_t refcount)
+{
+	size_t i;
+
+	for (i = 0; i < refcount; i++) {
+		if (git_reference_is_tag(ris[i].ref))
+			printcommitatom(&mainctx, fp, ris[i].ci,
+			                git_reference_shorthand(ris[i].ref));
+	}
+}
+
+struct logrow *
+logrow_get(const char *oid)
+{
+	size_t i;
+
+	if (!logrowcap)
+		return NULL;
+	for (i = fnv1a(FNV1A_INIT, oid, GIT_OID_HEXSZ) & (logrowcap - 1); logrows[i].oid[0];
+	     i = (i + 1) & (logrowcap - 1))
+		if (!strcmp(logrows[i].oid, oid))
+			return &logrows[i];
+	return NULL;
+}
+
+void
+logrow_fill(struct logrow *row, const struct commitinfo *ci)
+{
+	memcpy(row->oid, ci->oid, sizeof(row->oid));
+	row->summary = (char *)ci->summary;
+	row->hasauthor = ci->author != NULL;
+	if (ci->author)
+		row->when = ci->author->when;
+	row->filecount = ci->filecount;
+	row->addcount = ci->addcount;
+	row->delcount = ci->delcount;
+}
+
+/* empty row for oid, which is not in the table */
+struct logrow *
+logrow_new(const char *oid)
+{
+	struct logrow *old = logrows, *row;
+	size_t i, j, oldcap = logrowcap;
+
+	if ((nlogrows + 1) * 2 > logrowcap) {
+		logrowcap = logrowcap ? logrowcap * 2 : 1024;
+		if (!(logrows = calloc(logrowcap, sizeof(*logrows))))
+			err(1, "calloc");
+		for (i = 0; i < oldcap; i++) {
+			if (!old[i].oid[0])
+				continue;
+			for (j = fnv1a(FNV1A_INIT, old[i].oid, GIT_OID_HEXSZ) & (logrowcap - 1);
+			     logrows[j].oid[0]; j = (j + 1) & (logrowcap - 1))
+				;
+			logrows[j] = old[i];
+		}
+		free(old);
+	}
+	for (i = fnv1a(FNV1A_INIT, oid, GIT_OID_HEXSZ) & (logrowcap - 1); logrows[i].oid[0];
+	     i = (i + 1) & (logrowcap - 1))
+		;
+	row = &logrows[i];
+	memcpy(row->oid, oid, sizeof(row->oid));
+	nlogrows++;
+
+	return row;
+}
+
+/* Keep the log line of a commit for the branch logs. */
+struct logrow *
+logrow_add(const struct commitinfo *ci)
+{
+	struct logrow *row;
+
+	if ((row = logrow_get(ci->oid)))
+		return row;
+	row = logrow_new(ci->oid);
+	logrow_fill(row, ci);
+	if (ci->summary && !(row->summary = strdup(ci->summary)))
+		err(1, "strdup");
+
+	return row;
+}
+
+/* Load the rows of the branch logs of the previous run, with -c the commits
+   of HEAD come from the cache and are not in the table. Format: "<oid>
+   <time> <offset> <hasauthor> <files> <added> <deleted> <summary>". */
+void
+loadbranchescache(void)
+{
+	struct logrow *row;
+	char *line = NULL, *p;
+	size_t linesiz = 0, files, add, del;
+	ssize_t n;
+	long long t;
+	int off, hasauthor;
+	int r;
+	FILE *fp;
+
+	if (!(fp = fopen(branchescache, "r")))
+		return;
+	while ((n = getline(&line, &linesiz, fp)) > 0) {
+		if (line[n - 1] == '\n')
+			line[--n] = '\0';
+		if (n < GIT_OID_HEXSZ + 2 || line[GIT_OID_HEXSZ] != ' ')
+			continue;
+		line[GIT_OID_HEXSZ] = '\0';
+		p = line + GIT_OID_HEXSZ + 1;
+		if (sscanf(p, "%lld %d %d %zu %zu %zu %n", &t, &off, &hasauthor,
+		           &files, &add, &del, &r) != 6 || logrow_get(line))
+			continue;
+		row = logrow_new(line);
+		row->when.time = t;
+		row->when.offset = off;
+		row->hasauthor = hasauthor;
+		row->filecount = files;
+		row->addcount = add;
+		row->delcount = del;
+		if (p[r] && !(row->summary = strdup(p + r)))
+			err(1, "strdup");
+	}
+	free(line);
+	checkfileerror(fp, branchescache, 'r');
+	fclose(fp);
+}
+
+/* Write the rows of the branch logs of this run for the next one. */
+void
+writebranchescache(void)
+{
+	FILE *fp;
+	size_t i;
+	int fd;
+
+	if ((fd = mkstemp(branchestmp)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", branchestmp);
+	for (i = 0; i < logrowcap; i++) {
+		if (!logrows[i].oid[0] || !logrows[i].used)
+			continue;
+		fprintf(fp, "%s %lld %d %d %zu %zu %zu %s\n", logrows[i].oid,
+		        (long long)logrows[i].when.time, logrows[i].when.offset,
+		        logrows[i].hasauthor, logrows[i].filecount,
+		        logrows[i].addcount, logrows[i].delcount,
+		        logrows[i].summary ? logrows[i].summary : "");
+	}
+	checkfileerror(fp, branchestmp, 'w');
+	fclose(fp);
+}
+
+void
+printlogrow(struct renderctx *ctx, FILE *fp, const struct logrow *row)
+{
+	fputs("<tr><td>", fp);
+	if (row->hasauthor)
+		printtimeshort(ctx, fp, &(row->when));
+	fputs("</td><td>", fp);
+	if (row->summary) {
+		fprintf(fp, "<a href=\"%scommit/%s.html\">", ctx->relpath, row->oid);
+		xmlencode(fp, row->summary, strlen(row->summary));
+		fputs("</a>", fp);
+	}
+	fputs("</td>", fp);
+	//if (ci->author)
+	//	xmlencode(fp, ci->author->name, strlen(ci->author->name));
+	fputs("<td class=\"num\">", fp);
+	fprintf(fp, "%zu", row->filecount);
+	fputs("</td><td class=\"num\">", fp);
+	fprintf(fp, "+%zu", row->addcount);
+	fputs("</td><td class=\"num\">", fp);
+	fprintf(fp, "-%zu", row->delcount);
+	fputs("</td></tr>\n", fp);
+}
+
+void
+writelogline(struct renderctx *ctx, FILE *fp, struct commitinfo *ci)
+{
+	struct logrow row;
+
+	logrow_fill(&row, ci);
+	printlogrow(ctx, fp, &row);
+}
+
+struct histpath *
+histpath_get(const char *path)
+{
+	struct histpath *old;
+	size_t i, j, oldcap;
+	uint64_t h;
+
+	if ((nhistpaths + 1) * 2 > histpathcap) {
+		old = histpaths;
+		oldcap = histpathcap;
+		histpathcap = histpathcap ? histpathcap * 2 : 1024;
+		if (!(histpaths = calloc(histpathcap, sizeof(*histpaths))))
+			err(1, "calloc");
+		for (i = 0; i < oldcap; i++) {
+			if (!old[i].path)
+				continue;
+			h = fnv1a(FNV1A_INIT, old[i].path, strlen(old[i].path));
+			for (j = h & (histpathcap - 1); histpaths[j].path; j = (j + 1) & (histpathcap - 1))
+				;
+			histpaths[j] = old[i];
+		}
+		free(old);
+	}
+
+	h = fnv1a(FNV1A_INIT, path, strlen(path));
+	for (i = h & (histpathcap - 1); histpaths[i].path; i = (i + 1) & (histpathcap - 1)) {
+		if (!strcmp(histpaths[i].path, path))
+			return &histpaths[i];
+	}
+	if (!(histpaths[i].path = strdup(path)))
+		err(1, "strdup");
+	nhistpaths++;
+
+	return &histpaths[i];
+}
+
+void
+histrow_add(const char *path, size_t commit, size_t addcount, size_t delcount,
+            int changed)
+{
+	struct histpath *hp;
+
+	/* NOTE: paths with a newline cannot be stored in the paths cache */
+	if (strchr(path, '\n'))
+		return;
+	hp = histpath_get(path);
+	/* grow by powers of 2 */
+	if (!(hp->nrows & (hp->nrows - 1)) &&
+	    !(hp->rows = reallocarray(hp->rows, hp->nrows ? hp->nrows * 2 : 1, sizeof(*hp->rows))))
+		err(1, "realloc");
+	hp->rows[hp->nrows].commit = commit;
+	hp->rows[hp->nrows].addcount = addcount;
+	hp->rows[hp->nrows].delcount = delcount;
+	hp->nrows++;
+	hp->changed |= changed;
+}
+
+size_t
+histcommit_add(const char *oid, git_time_t t, const char *summary)
+{
+	struct histcommit *hc;
+
+	if (!(histcommits = reallocarray(histcommits, nhistcommits + 1, sizeof(*histcommits))))
+		err(1, "realloc");
+	hc = &histcommits[nhistcommits];
+	strlcpy(hc->oid, oid, sizeof(hc->oid));
+	hc->time = t;
+	if (!(hc->summary = strdup(summary)))
+		err(1, "strdup");
+
+	return nhistcommits++;
+}
+
+/* Add the changed paths of the commit from its diff to the per-file history
+   and the new paths cache. */
+void
+addhistory(struct commitinfo *ci)
+{
+	const git_diff_delta *delta;
+	const char *summary;
+	git_time_t t;
+	size_t c, i;
+	int changed;
+
+	changed = !haschanged || pathset_has(&newcommits, ci->oid);
+	summary = ci->summary ? ci->summary : "";
+	t = ci->author ? ci->author->when.time : 0;
+	c = histcommit_add(ci->oid, t, summary);
+	if (wpathsfp)
+		fprintf(wpathsfp, "C %s %lld %s\n", ci->oid, (long long)t, summary);
+
+	for (i = 0; i < ci->ndeltas; i++) {
+		delta = git_diff_get_delta(ci->diff, i);
+		histrow_add(delta->new_file.path, c,
+		            ci->deltas[i]->addcount, ci->deltas[i]->delcount, changed);
+		if (strcmp(delta->old_file.path, delta->new_file.path))
+			histrow_add(delta->old_file.path, c,
+			            ci->deltas[i]->addcount, ci->deltas[i]->delcount, changed);
+		if (wpathsfp && !strchr(delta->new_file.path, '\n'))
+			fprintf(wpathsfp, "P %zu %zu %s\n", ci->deltas[i]->addcount,
+			        ci->deltas[i]->delcount, delta->new_file.path);
+		if (wpathsfp && strcmp(delta->old_file.path, delta->new_file.path) &&
+		    !strchr(delta->old_file.path, '\n'))
+			fprintf(wpathsfp, "P %zu %zu %s\n", ci->deltas[i]->addcount,
+			        ci->deltas[i]->delcount, delta->old_file.path);
+	}
+}
+
+/* Open the paths cache of the previous run and the new one. The old one is
+   only used when it is valid up to the same commit as the log cache. */
+void
+openpathscache(const git_oid *head)
+{
+	char line[GIT_OID_HEXSZ + 2], oid[GIT_OID_HEXSZ + 1];
+	int fd;
+
+	if ((rpathsfp = fopen(pathscache, "r"))) {
+		if (!fgets(line, sizeof(line), rpathsfp) || strcmp(line, lastoidstr)) {
+			fclose(rpathsfp);
+			rpathsfp = NULL;
+		}
+	}
+
+	if ((fd = mkstemp(pathstmp)) == -1)
+		err(1, "mkstemp");
+	if (!(wpathsfp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", pathstmp);
+	git_oid_tostr(oid, sizeof(oid), head);
+	fprintf(wpathsfp, "%s\n", oid);
+}
+
+/* Load the cached commits after the new ones and copy them to the new paths
+   cache. Format: "C <oid> <time> <summary>" for each commit followed by
+   "P <added> <deleted> <path>" for each of its changed paths. */
+void
+closepathscache(void)
+{
+	char *line = NULL, *p, *q;
+	size_t linesiz = 0, c = 0, add, del;
+	ssize_t n;
+	long long t;
+	int hascommit = 0;
+
+	while (rpathsfp && (n = getline(&line, &linesiz, rpathsfp)) > 0) {
+		fwrite(line, 1, n, wpathsfp);
+		if (line[n - 1] == '\n')
+			line[--n] = '\0';
+		if (line[0] == 'C' && n > GIT_OID_HEXSZ + 3 && line[GIT_OID_HEXSZ + 2] == ' ') {
+			line[GIT_OID_HEXSZ + 2] = '\0';
+			t = strtoll(line + GIT_OID_HEXSZ + 3, &p, 10);
+			c = histcommit_add(line + 2, t, *p == ' ' ? p + 1 : "");
+			hascommit = 1;
+		} else if (line[0] == 'P' && hascommit) {
+			add = strtoull(line + 1, &p, 10);
+			del = strtoull(p, &q, 10);
+			if (*q == ' ')
+				histrow_add(q + 1, c, add, del, 0);
+		}
+	}
+	free(line);
+	if (rpathsfp) {
+		checkfileerror(rpathsfp, pathscache, 'r');
+		fclose(rpathsfp);
+	}
+	checkfileerror(wpathsfp, pathstmp, 'w');
+	fclose(wpathsfp);
+}
+
+/* Open .stagit-log for the rows of this run. With -p the previous one is
+   used when it was written for the old commit of the branch. Format: the
+   commit and the count of the commits not shown, then a line per row. */
+void
+openlogstate(const git_oid *head)
+{
+	char buf[GIT_OID_HEXSZ + 32];
+	git_oid id;
+	int fd;
+
+	if (postreceive && hasheadold && !filehist &&
+	    (rlogfp = fopen(logstate, "r"))) {
+		if (!fgets(buf, sizeof(buf), rlogfp) ||
+		    strlen(buf) < GIT_OID_HEXSZ + 2 || buf[GIT_OID_HEXSZ] != ' ' ||
+		    git_oid_fromstrn(&id, buf, GIT_OID_HEXSZ) ||
+		    !git_oid_equal(&id, &headold) ||
+		    git_graph_descendant_of(repo, head, &headold) != 1) {
+			fclose(rlogfp);
+			rlogfp = NULL;
+		} else {
+			logstaterem = strtoull(buf + GIT_OID_HEXSZ + 1, NULL, 10);
+		}
+	}
+
+	if ((fd = mkstemp(logstatetmp)) == -1)
+		err(1, "mkstemp");
+	if (!(wlogfp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", logstatetmp);
+	/* the count is filled in by closelogstate() */
+	git_oid_tostr(buf, sizeof(buf), head);
+	fprintf(wlogfp, "%s %20d\n", buf, 0);
+}
+
+void
+closelogstate(void)
+{
+	if (fseek(wlogfp, GIT_OID_HEXSZ + 1, SEEK_SET) == -1)
+		err(1, "fseek: '%s'", logstatetmp);
+	fprintf(wlogfp, "%20zu", logstaterem);
+	checkfileerror(wlogfp, logstatetmp, 'w');
+	fclose(wlogfp);
+	wlogfp = NULL;
+}
+
+/* Write history/<path>.html for each file in the tree of HEAD. */
+void
+writehistory(struct renderctx *ctx, const git_oid *head)
+{
+	git_commit *commit = NULL;
+	git_tree *tree = NULL;
+	git_tree_entry *entry;
+	struct histpath *hp;
+	struct histcommit *hc;
+	git_time_t t;
+	git_time when;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	size_t i, j;
+	FILE *fp;
+	int r;
+
+	if (git_commit_lookup(&commit, ctx->repo, head) || git_commit_tree(&tree, commit))
+		goto end;
+
+	for (i = 0; i < histpathcap; i++) {
+		hp = &histpaths[i];
+		if (!hp->path || git_tree_entry_bypath(&entry, tree, hp->path))
+			continue;
+		r = git_tree_entry_type(entry) == GIT_OBJ_BLOB;
+		git_tree_entry_free(entry);
+		if (!r)
+			continue;
+
+		r = snprintf(path, sizeof(path), "history/%s.html", hp->path);
+		if (r < 0 || (size_t)r >= sizeof(path))
+			errx(1, "path truncated: 'history/%s.html'", hp->path);
+		/* no commit of the push changed it */
+		if (haschanged && !hp->changed && !access(path, F_OK))
+			continue;
+		if (mkpagedir(path, tmp, sizeof(tmp)))
+			continue;
+		ctx->relpath = tmp;
+
+		fp = pageopen(path);
+		writeheader(fp, ctx->relpath, hp->path);
+		fprintf(fp, "<div class=\"container\"><p><a href=\"%sfile/", ctx->relpath);
+		percentencode(fp, hp->path, strlen(hp->path));
+		fputs(".html\">", fp);
+		xmlencode(fp, hp->path, strlen(hp->path));
+		fputs("</a></p></div>", fp);
+		fputs("<table id=\"log\"><thead>\n<tr><td><b>Date</b></td><td><b>Commit message</b></td>"
+		      "<td class=\"num\"><b>+</b></td><td class=\"num\"><b>-</b></td></tr>\n</thead><tbody>\n", fp);
+		for (j = 0; j < hp->nrows; j++) {
+			hc = &histcommits[hp->rows[j].commit];
+			t = hc->time;
+			memset(&when, 0, sizeof(when));
+			when.time = t;
+			fputs("<tr><td>", fp);
+			printtimeshort(ctx, fp, &when);
+			fprintf(fp, "</td><td><a href=\"%scommit/%s.html\">", ctx->relpath, hc->oid);
+			xmlencode(fp, hc->summary, strlen(hc->summary));
+			fprintf(fp, "</a></td><td class=\"num\">+%zu</td><td class=\"num\">-%zu</td></tr>\n",
+			        hp->rows[j].addcount, hp->rows[j].delcount);
+		}
+		fputs("</tbody></table>", fp);
+		writefooter(fp);
+		pageclose(fp, path);
+	}
+	ctx->relpath = "";
+
+end:
+	git_tree_free(tree);
+	git_commit_free(commit);
+	for (i = 0; i < histpathcap; i++) {
+		free(histpaths[i].path);
+		free(histpaths[i].rows);
+	}
+	free(histpaths);
+	for (i = 0; i < nhistcommits; i++)
+		free(histcommits[i].summary);
+	free(histcommits);
+	for (i = 0; i < newcommits.cap; i++)
+		free(newcommits.slots[i]);
+	free(newcommits.slots);
+}
+
+int
+oidcmp(const void *a, const void *b)
+{
+	return git_oid_cmp(a, b);
+}
+
+/* Read the set of rendered commits: the raw ids, sorted. Without a valid
+   file, or when the commit directory changed after it was written, it is
+   built from the names in the commit directory. */
+void
+loadcommitset(void)
+{
+	struct dirent *de;
+	struct stat st, dst;
+	size_t cap = 0, i, n = 0;
+	FILE *fp;
+	DIR *d;
+	int valid = 0, stale;
+
+	if ((fp = fopen(commitsfile, "r"))) {
+		if (!fstat(fileno(fp), &st) && st.st_size % GIT_OID_RAWSZ == 0) {
+			n = st.st_size / GIT_OID_RAWSZ;
+			if (!(rendered = reallocarray(NULL, n + 1, sizeof(*rendered))))
+				err(1, "realloc");
+			if (fread(rendered, GIT_OID_RAWSZ, n, fp) == n) {
+				for (i = 1; i < n; i++)
+					if (git_oid_cmp(&rendered[i - 1], &rendered[i]) >= 0)
+						break;
+				valid = i >= n;
+			}
+		}
+		fclose(fp);
+		/* pages added or removed by hand, in nanoseconds as a page can
+		   be removed in the same second the file was written */
+		stale = valid && (stat("commit", &dst) ||
+		        dst.st_mtim.tv_sec > st.st_mtim.tv_sec ||
+		        (dst.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+		         dst.st_mtim.tv_nsec > st.st_mtim.tv_nsec));
+		if (valid && !stale) {
+			nrendered = n;
+			goto done;
+		}
+		if (!stale)
+			warnx("%s: invalid, reading the commit directory", commitsfile);
+		free(rendered);
+		rendered = NULL;
+	}
+
+	if ((d = opendir("commit"))) {
+		while ((de = readdir(d))) {
+			if (strlen(de->d_name) != GIT_OID_HEXSZ + 5 ||
+			    strcmp(de->d_name + GIT_OID_HEXSZ, ".html"))
+				continue;
+			if (nrendered == cap) {
+				cap = cap ? cap * 2 : 1024;
+				if (!(rendered = reallocarray(rendered, cap, sizeof(*rendered))))
+					err(1, "realloc");
+			}
+			if (!git_oid_fromstrn(&rendered[nrendered], de->d_name, GIT_OID_HEXSZ))
+				nrendered++;
+		}
+		closedir(d);
+		qsort(rendered, nrendered, sizeof(*rendered), oidcmp);
+	}
+done:
+	if (!(renderedgone = calloc(nrendered + 1, 1)))
+		err(1, "calloc");
+}
+
+int
+commitset_has(const git_oid *id)
+{
+	git_oid *p;
+	char oid[GIT_OID_HEXSZ + 1];
+
+	if ((p = bsearch(id, rendered, nrendered, sizeof(*rendered), oidcmp)) &&
+	    !renderedgone[p - rendered])
+		return 1;
+	git_oid_tostr(oid, sizeof(oid), id);
+	return pathset_has(&renderedadd, oid);
+}
+
+void
+commitset_add(const git_oid *id)
+{
+	char oid[GIT_OID_HEXSZ + 1];
+
+	if (!commitset_has(id)) {
+		git_oid_tostr(oid, sizeof(oid), id);
+		pathset_add(&renderedadd, oid);
+	}
+}
+
+/* the page of a commit was removed, the pages written in this run are
+   reachable and not removed */
+void
+commitset_del(const git_oid *id)
+{
+	git_oid *p;
+
+	if ((p = bsearch(id, rendered, nrendered, sizeof(*rendered), oidcmp)))
+		renderedgone[p - rendered] = 1;
+}
+
+void
+writecommitset(void)
+{
+	char tmppath[64] = ".stagit-commits.XXXXXXXXXXXX";
+	git_oid *ids;
+	size_t n = 0, i;
+	FILE *fp;
+	int fd;
+
+	if (!(ids = reallocarray(NULL, nrendered + renderedadd.n + 1, sizeof(*ids))))
+		err(1, "realloc");
+	for (i = 0; i < nrendered; i++)
+		if (!renderedgone[i])
+			ids[n++] = rendered[i];
+	for (i = 0; i < renderedadd.cap; i++) {
+		if (renderedadd.slots[i] &&
+		    !git_oid_fromstr(&ids[n], renderedadd.slots[i]))
+			n++;
+		free(renderedadd.slots[i]);
+	}
+	free(renderedadd.slots);
+	qsort(ids, n, sizeof(*ids), oidcmp);
+
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	fwrite(ids, GIT_OID_RAWSZ, n, fp);
+	checkfileerror(fp, tmppath, 'w');
+	fclose(fp);
+	if (rename(tmppath, commitsfile))
+		err(1, "rename: '%s' to '%s'", tmppath, commitsfile);
+
+	free(ids);
+	free(rendered);
+	free(renderedgone);
+}
+
+void
+writecommitpage(struct renderctx *ctx, struct commitinfo *ci, const char *path)
+{
+	FILE *fp;
+
+	commitset_add(ci->id);
+
+	ctx->relpath = "../";
+	fp = pageopen(path);
+	writeheader(fp, ctx->relpath, ci->summary);
+	fputs("<div class=\"container\"><table id=\"container\"><tr><td>", fp);
+	printshowfile(ctx, fp, ci);
+	fputs("</pre></td></tr></table></div>\n", fp);
+	writefooter(fp);
+	pageclose(fp, path);
+	if (ci->split)
+		writesplitcommit(ctx, ci);
+}
+
+/* Walk the history once: write the log lines and commit pages to fp and the
+   first commits to the Atom feed atomfp. */
+int
+writelog(struct renderctx *ctx, FILE *fp, FILE *atomfp, const git_oid *oid)
+{
+	struct commitinfo *ci;
+	git_revwalk *w = NULL;
+	git_oid id;
+	char path[PATH_MAX], oidstr[GIT_OID_HEXSZ + 1], *line = NULL;
+	size_t remcommits = 0, remfeed = 100; /* last 'remfeed' commits */
+	size_t linesiz = 0;
+	ssize_t linelen;
+	int cached = 0, r;
+
+	git_revwalk_new(&w, ctx->repo);
+	git_revwalk_push(w, oid);
+	/* -p: the rows of the older commits are in .stagit-log */
+	if (rlogfp)
+		git_revwalk_hide(w, &headold);
+
+	while (!git_revwalk_next(&id, w)) {
+		ctx->relpath = "";
+
+		if (cachefile && !memcmp(&id, &lastoid, sizeof(id)))
+			cached = 1;
+		/* the log lines from here on come from the cache file, only
+		   the Atom feed can still need entries */
+		if (cached) {
+			/* without a valid paths cache the changed paths of the
+			   cached commits are still needed for the history */
+			if (!remfeed && (!filehist || rpathsfp))
+				break;
+			if (!(ci = commitinfo_getbyoid(ctx, &id, &ctx->arena)))
+				break;
+			if (remfeed) {
+				printcommitatom(ctx, atomfp, ci, "");
+				remfeed--;
+			}
+			if (filehist && !rpathsfp && !commitinfo_getstats(ci))
+				addhistory(ci);
+			commitinfo_free(ci);
+			arena_reset(&ctx->arena);
+			continue;
+		}
+
+		git_oid_tostr(oidstr, sizeof(oidstr), &id);
+		r = snprintf(path, sizeof(path), "commit/%s.html", oidstr);
+		if (r < 0 || (size_t)r >= sizeof(path))
+			errx(1, "path truncated: 'commit/%s.html'", oidstr);
+		r = commitset_has(&id) ? 0 : -1;
+
+		/* optimization: if there are no log lines to write and
+		   the commit file already exists: skip the diffstat */
+		if (!nlogcommits) {
+			remcommits++;
+			if (!r && !remfeed && !filehist)
+				continue;
+		}
+
+		if (!(ci = commitinfo_getbyoid(ctx, &id, &ctx->arena)))
+			break;
+		if (remfeed) {
+			printcommitatom(ctx, atomfp, ci, "");
+			remfeed--;
+		}
+		/* only looked up for the Atom feed */
+		if (!nlogcommits && !r && !filehist)
+			goto err;
+
+		/* diffstat: for stagit HTML required for the log.html line */
+		if (commitinfo_getstats(ci) == -1)
+			goto err;
+		if (filehist)
+			addhistory(ci);
+
+		if (nlogcommits != 0) {
+			writelogline(ctx, fp, ci);
+			if (wlogfp)
+				writelogline(ctx, wlogfp, ci);
+			if (nlogcommits > 0)
+				nlogcommits--;
+		}
+
+		if (cachefile)
+			writelogline(ctx, wcachefp, ci);
+
+		if (nlogbranches)
+			logrow_add(ci);
+
+		/* check if file exists if so skip it */
+		if (r)
+			writecommitpage(ctx, ci, path);
+err:
+		commitinfo_free(ci);
+		arena_reset(&ctx->arena);
+	}
+	git_revwalk_free(w);
+	w = NULL;
+
+	if (rlogfp) {
+		while ((linelen = getline(&line, &linesiz, rlogfp)) > 0) {
+			if (nlogcommits == 0) {
+				remcommits++;
+				continue;
+			}
+			fwrite(line, 1, linelen, fp);
+			fwrite(line, 1, linelen, wlogfp);
+			if (nlogcommits > 0)
+				nlogcommits--;
+		}
+		free(line);
+		checkfileerror(rlogfp, logstate, 'r');
+		fclose(rlogfp);
+		rlogfp = NULL;
+		remcommits += logstaterem;
+
+		/* the feed continues with the old commits */
+		if (remfeed && !git_revwalk_new(&w, ctx->repo) &&
+		    !git_revwalk_push(w, &headold)) {
+			while (remfeed && !git_revwalk_next(&id, w)) {
+				if (!(ci = commitinfo_getbyoid(ctx, &id, &ctx->arena)))
+					break;
+				printcommitatom(ctx, atomfp, ci, "");
+				remfeed--;
+				commitinfo_free(ci);
+				arena_reset(&ctx->arena);
+			}
+		}
+		git_revwalk_free(w);
+	}
+	arena_free(&ctx->arena);
+	logstaterem = remcommits;
+
+	if (nlogcommits == 0 && remcommits != 0) {
+		fprintf(fp, "<tr><td></td><td colspan=\"5\">"
+		        "%zu more commits remaining, fetch the repository"
+		        "</td></tr>\n", remcommits);
+	}
+
+	ctx->relpath = "";
+
+	return 0;
+}
+
+/* Write log/<branch>.html. Commits already seen by the log of HEAD or an
+   other branch reuse their log line and page. */
+void
+writebranchlog(struct renderctx *ctx, const char *branch)
+{
+	struct commitinfo *ci;
+	struct logrow *row;
+	git_revwalk *w = NULL;
+	git_oid id, tip;
+	char refname[PATH_MAX], path[PATH_MAX], cpath[PATH_MAX], tmp[PATH_MAX] = "";
+	char oidstr[GIT_OID_HEXSZ + 1];
+	long long rem = nbranchcommits;
+	size_t remcommits = 0;
+	FILE *fp;
+	int past, r;
+
+	r = snprintf(refname, sizeof(refname), "refs/heads/%s", branch);
+	if (r < 0 || (size_t)r >= sizeof(refname) ||
+	    git_reference_name_to_id(&tip, ctx->repo, refname)) {
+		warnx("no such branch: '%s'", branch);
+		return;
+	}
+	r = snprintf(path, sizeof(path), "log/%s.html", branch);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: 'log/%s.html'", branch);
+	if (mkpagedir(path, tmp, sizeof(tmp)))
+		err(1, "mkdir: '%s'", path);
+
+	ctx->relpath = tmp;
+	fp = pageopen(path);
+	writeheader(fp, ctx->relpath, branch);
+	fputs("<table id=\"log\"><thead>\n<tr><td><b>Date</b></td><td><b>Commit message</b></td>"
+	      "<td class=\"num\"><b>Files</b></td><td class=\"num\"><b>+</b></td>"
+	      "<td class=\"num\"><b>-</b></td></tr>\n</thead><tbody>\n", fp);
+
+	git_revwalk_new(&w, ctx->repo);
+	git_revwalk_push(w, &tip);
+	while (!git_revwalk_next(&id, w)) {
+		/* past -l only the commit pages are written, as for HEAD */
+		if ((past = nbranchcommits && !rem))
+			remcommits++;
+		git_oid_tostr(oidstr, sizeof(oidstr), &id);
+		if (!(row = logrow_get(oidstr))) {
+			if (past && commitset_has(&id))
+				continue;
+			if (!(ci = commitinfo_getbyoid(ctx, &id, &ctx->arena)))
+				break;
+			if (commitinfo_getstats(ci) == -1) {
+				commitinfo_free(ci);
+				arena_reset(&ctx->arena);
+				continue;
+			}
+			if (!past)
+				row = logrow_add(ci);
+			r = snprintf(cpath, sizeof(cpath), "commit/%s.html", oidstr);
+			if (r < 0 || (size_t)r >= sizeof(cpath))
+				errx(1, "path truncated: 'commit/%s.html'", oidstr);
+			if (!commitset_has(&id))
+				writecommitpage(ctx, ci, cpath);
+			commitinfo_free(ci);
+			arena_reset(&ctx->arena);
+		}
+		if (past)
+			continue;
+		ctx->relpath = tmp;
+		printlogrow(ctx, fp, row);
+		row->used = 1;
+		if (rem > 0)
+			rem--;
+	}
+	git_revwalk_free(w);
+	arena_free(&ctx->arena);
+
+	if (remcommits) {
+		fprintf(fp, "<tr><td></td><td colspan=\"5\">"
+		        "%zu more commits remaining, fetch the repository"
+		        "</td></tr>\n", remcommits);
+	}
+	fputs("</tbody></table>", fp);
+	writefooter(fp);
+	pageclose(fp, path);
+
+	ctx->relpath = "";
+}
+
+int
+ismarkdown(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 3 && !strcasecmp(name + len - 3, ".md");
+}
+
+size_t
+writeblob(struct renderctx *ctx, git_object *obj, const char *fpath,
+          const char *filename, size_t filesize)
+{
+	char tmp[PATH_MAX] = "";
+	size_t lc = 0;
+	FILE *fp;
+
+	if (mkpagedir(fpath, tmp, sizeof(tmp)))
+		return -1;
+	ctx->relpath = tmp;
+
+	fp = pageopen(fpath);
+	writeheader(fp, ctx->relpath, filename);
+	fputs("<div class=\"container\"><p>", fp);
+	xmlencode(fp, filename, strlen(filename));
+	fprintf(fp, " <span class=\"desc\">(%zuB)</span>", filesize);
+	if (blame && obj && !git_blob_is_binary((git_blob *)obj)) {
+		fprintf(fp, " <a href=\"%sblame/", ctx->relpath);
+		percentencode(fp, fpath + strlen("file/"), strlen(fpath + strlen("file/")));
+		fputs("\">blame</a>", fp);
+	}
+	if (filehist) {
+		fprintf(fp, " <a href=\"%shistory/", ctx->relpath);
+		percentencode(fp, fpath + strlen("file/"), strlen(fpath + strlen("file/")));
+		fputs("\">history</a>", fp);
+	}
+	if (ismarkdown(filename) && obj && !git_blob_is_binary((git_blob *)obj)) {
+		fprintf(fp, " <a href=\"%srender/", ctx->relpath);
+		percentencode(fp, fpath + strlen("file/"), strlen(fpath + strlen("file/")));
+		fputs("\">rendered</a>", fp);
+	}
+	fputs("</p></div>", fp);
+
+	if (!obj)
+		fputs("<p>File too large to show.</p>\n", fp);
+	else if (git_blob_is_binary((git_blob *)obj))
+		fputs("<p>Binary file.</p>\n", fp);
+	else
+		lc = writeblobhtml(ctx, fp, (git_blob *)obj, filename);
+
+	writefooter(fp);
+	pageclose(fp, fpath);
+
+	ctx->relpath = "";
+
+	return lc;
+}
+
+void
+blamecachepath(char *buf, size_t bufsiz, const char *path)
+{
+	int r;
+
+	r = snprintf(buf, bufsiz, "%s/%016llx", blamecachedir,
+	             (unsigned long long)fnv1a(FNV1A_INIT, path, strlen(path)));
+	if (r < 0 || (size_t)r >= bufsiz)
+		errx(1, "path truncated: '%s'", blamecachedir);
+}
+
+/* Read the cached blame of path. Format: the path, then the blob id, the
+   commit it was valid for and the line count, then "<count> <commit>" for
+   each run of lines from the same commit. */
+int
+readblamecache(const char *path, git_oid *blobid, git_oid *headid,
+               git_oid **lines, size_t *nlines)
+{
+	FILE *fp;
+	char cpath[PATH_MAX], buf[PATH_MAX + 2], blobstr[GIT_OID_HEXSZ + 1];
+	char headstr[GIT_OID_HEXSZ + 1], oidstr[GIT_OID_HEXSZ + 1];
+	git_oid id;
+	size_t n, count, i = 0;
+	int ret = -1;
+
+	*lines = NULL;
+	blamecachepath(cpath, sizeof(cpath), path);
+	if (!(fp = fopen(cpath, "r")))
+		return -1;
+	/* the name is a hash: check for the same path */
+	if (!fgets(buf, sizeof(buf), fp) || strcspn(buf, "\n") != strlen(path) ||
+	    strncmp(buf, path, strlen(path)))
+		goto end;
+	if (!fgets(buf, sizeof(buf), fp) ||
+	    sscanf(buf, "%40s %40s %zu", blobstr, headstr, &n) != 3 ||
+	    git_oid_fromstr(blobid, blobstr) || git_oid_fromstr(headid, headstr))
+		goto end;
+	if (!(*lines = reallocarray(NULL, n ? n : 1, sizeof(git_oid))))
+		err(1, "realloc");
+	while (i < n && fgets(buf, sizeof(buf), fp)) {
+		if (sscanf(buf, "%zu %40s", &count, oidstr) != 2 ||
+		    git_oid_fromstr(&id, oidstr) || count > n - i)
+			goto end;
+		for (; count; count--)
+			(*lines)[i++] = id;
+	}
+	if (i == n) {
+		*nlines = n;
+		ret = 0;
+	}
+end:
+	if (ret) {
+		free(*lines);
+		*lines = NULL;
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+void
+writeblamecache(const char *path, const git_oid *blobid, const git_oid *lines,
+                size_t nlines)
+{
+	FILE *fp;
+	char cpath[PATH_MAX], tmppath[PATH_MAX], oid[GIT_OID_HEXSZ + 1];
+	size_t i, j;
+	int fd, r;
+
+	if (mkdir(blamecachedir, S_IRWXU | S_IRWXG | S_IRWXO) < 0 && errno != EEXIST)
+		err(1, "mkdir: '%s'", blamecachedir);
+	blamecachepath(cpath, sizeof(cpath), path);
+	r = snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", cpath);
+	if (r < 0 || (size_t)r >= sizeof(tmppath))
+		errx(1, "path truncated: '%s.XXXXXX'", cpath);
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+
+	fprintf(fp, "%s\n", path);
+	git_oid_tostr(oid, sizeof(oid), blobid);
+	fprintf(fp, "%s ", oid);
+	git_oid_tostr(oid, sizeof(oid), blamehead);
+	fprintf(fp, "%s %zu\n", oid, nlines);
+	for (i = 0; i < nlines; i = j) {
+		for (j = i + 1; j < nlines && git_oid_equal(&lines[i], &lines[j]); j++)
+			;
+		git_oid_tostr(oid, sizeof(oid), &lines[i]);
+		fprintf(fp, "%zu %s\n", j - i, oid);
+	}
+	checkfileerror(fp, tmppath, 'w');
+	fclose(fp);
+	if (rename(tmppath, cpath))
+		err(1, "rename: '%s' to '%s'", tmppath, cpath);
+}
+
+/* Blame of the file in HEAD by libgit2, one commit id per line. */
+int
+blamefull(struct renderctx *ctx, const char *path, git_oid **lines, size_t *nlines)
+{
+	git_blame *b = NULL;
+	git_blame_options opts;
+	const git_blame_hunk *hunk;
+	uint32_t i, nhunks;
+	size_t k, n = 0;
+
+	git_blame_init_options(&opts, GIT_BLAME_OPTIONS_VERSION);
+	opts.newest_commit = *blamehead;
+	if (git_blame_file(&b, ctx->repo, path, &opts))
+		return -1;
+
+	nhunks = git_blame_get_hunk_count(b);
+	for (i = 0; i < nhunks; i++) {
+		hunk = git_blame_get_hunk_byindex(b, i);
+		n += hunk->lines_in_hunk;
+	}
+	if (!(*lines = reallocarray(NULL, n ? n : 1, sizeof(git_oid))))
+		err(1, "realloc");
+	for (i = 0; i < nhunks; i++) {
+		hunk = git_blame_get_hunk_byindex(b, i);
+		for (k = 0; k < hunk->lines_in_hunk &&
+		     hunk->final_start_line_number + k <= n; k++)
+			(*lines)[hunk->final_start_line_number - 1 + k] = hunk->final_commit_id;
+	}
+	*nlines = n;
+	git_blame_free(b);
+
+	return 0;
+}
+
+/* Apply the line changes of patch to the owners of the old lines, the added
+   lines are owned by commit. */
+void
+blameapply(git_patch *patch, const git_oid *commit, git_oid **lines, size_t *nlines)
+{
+	const git_diff_hunk *hunk;
+	const git_diff_line *line;
+	git_oid *old = *lines, *new = NULL;
+	size_t nold = *nlines, nnew = 0, cap = 0, o = 0, start, nhunklines, j, k;
+
+#define BLAMEPUSH(id) do { \
+	if (nnew == cap && !(new = reallocarray(new, (cap = cap ? cap * 2 : 64), sizeof(git_oid)))) \
+		err(1, "realloc"); \
+	new[nnew++] = (id); \
+} while (0)
+
+	for (j = 0; j < git_patch_num_hunks(patch); j++) {
+		if (git_patch_get_hunk(&hunk, &nhunklines, patch, j))
+			break;
+		/* without old lines the start is the line after which is added */
+		start = hunk->old_lines ? (size_t)hunk->old_start - 1 : (size_t)hunk->old_start;
+		for (; o < start && o < nold; o++)
+			BLAMEPUSH(old[o]);
+		for (k = 0; !git_patch_get_line_in_hunk(&line, patch, j, k); k++) {
+			if (line->origin == GIT_DIFF_LINE_CONTEXT && o < nold)
+				BLAMEPUSH(old[o++]);
+			else if (line->origin == GIT_DIFF_LINE_DELETION)
+				o++;
+			else if (line->origin == GIT_DIFF_LINE_ADDITION)
+				BLAMEPUSH(*commit);
+		}
+	}
+	for (; o < nold; o++)
+		BLAMEPUSH(old[o]);
+#undef BLAMEPUSH
+
+	free(old);
+	*lines = new;
+	*nlines = nnew;
+}
+
+/* Update the cached blame of path from the blob it was computed for to the
+   blob in HEAD by applying the changes of each first-parent commit since. */
+int
+blameupdate(struct renderctx *ctx, const char *path, const git_oid *cachedhead,
+            const git_oid *cachedblob, const git_oid *newblob, git_oid **lines,
+            size_t *nlines)
+{
+	git_revwalk *w = NULL;
+	git_commit *commit = NULL;
+	git_tree *tree = NULL;
+	git_tree_entry *entry = NULL;
+	git_blob *oldb = NULL, *newb = NULL;
+	git_patch *patch = NULL;
+	git_diff_options opts;
+	git_oid id, cur = *cachedblob;
+	size_t i;
+	int ret = -1;
+
+	if (!git_oid_equal(cachedhead, blamehead) &&
+	    git_graph_descendant_of(ctx->repo, blamehead, cachedhead) != 1)
+		return -1;
+
+	/* the range is the same for all files cached in the same run */
+	if (!ctx->hasblamerange || !git_oid_equal(&ctx->blamerangebase, cachedhead)) {
+		ctx->nblamerange = 0;
+		if (git_revwalk_new(&w, ctx->repo) ||
+		    git_revwalk_push(w, blamehead) || git_revwalk_hide(w, cachedhead))
+			goto end;
+		git_revwalk_simplify_first_parent(w);
+		git_revwalk_sorting(w, GIT_SORT_TOPOLOGICAL | GIT_SORT_REVERSE);
+		while (!git_revwalk_next(&id, w)) {
+			if (!(ctx->blamerange = reallocarray(ctx->blamerange,
+			    ctx->nblamerange + 1, sizeof(git_oid))))
+				err(1, "realloc");
+			ctx->blamerange[ctx->nblamerange++] = id;
+		}
+		ctx->blamerangebase = *cachedhead;
+		ctx->hasblamerange = 1;
+	}
+
+	git_diff_init_options(&opts, GIT_DIFF_OPTIONS_VERSION);
+	opts.context_lines = 0;
+	for (i = 0; i < ctx->nblamerange; i++) {
+		if (git_commit_lookup(&commit, ctx->repo, &ctx->blamerange[i]) ||
+		    git_commit_tree(&tree, commit))
+			goto end;
+		if (!git_tree_entry_bypath(&entry, tree, path)) {
+			id = *git_tree_entry_id(entry);
+			git_tree_entry_free(entry);
+			entry = NULL;
+		} else {
+			memset(&id, 0, sizeof(id));
+		}
+
+		if (!git_oid_equal(&id, &cur)) {
+			if (git_oid_iszero(&id)) {
+				/* removed, a later commit adds it back */
+				*nlines = 0;
+			} else if (git_blob_lookup(&newb, ctx->repo, &id) ||
+			           (!git_oid_iszero(&cur) && git_blob_lookup(&oldb, ctx->repo, &cur)) ||
+			           git_patch_from_blobs(&patch, oldb, path, newb, path, &opts)) {
+				goto end;
+			} else {
+				blameapply(patch, &ctx->blamerange[i], lines, nlines);
+				git_patch_free(patch);
+				patch = NULL;
+			}
+			git_blob_free(oldb);
+			git_blob_free(newb);
+			oldb = newb = NULL;
+			cur = id;
+		}
+		git_tree_free(tree);
+		git_commit_free(commit);
+		tree = NULL;
+		commit = NULL;
+	}
+	if (git_oid_equal(&cur, newblob))
+		ret = 0;
+end:
+	git_revwalk_free(w);
+	git_blob_free(oldb);
+	git_blob_free(newb);
+	git_tree_free(tree);
+	git_commit_free(commit);
+
+	return ret;
+}
+
+/* Write blame/<path>.html for the blob in HEAD. An unchanged blob reuses the
+   cached blame, a changed one updates it, otherwise libgit2 blames the file. */
+void
+writeblame(struct renderctx *ctx, const git_blob *blob, const char *entrypath,
+           const char *filename)
+{
+	const char *s = git_blob_rawcontent(blob);
+	git_oid cblob, chead, *lines = NULL, none;
+	char fpath[PATH_MAX], tmp[PATH_MAX], oid[GIT_OID_HEXSZ + 1];
+	size_t len, nlines = 0, i, n, prev;
+	FILE *fp;
+	int r;
+
+	r = snprintf(fpath, sizeof(fpath), "blame/%s.html", entrypath);
+	if (r < 0 || (size_t)r >= sizeof(fpath))
+		errx(1, "path truncated: 'blame/%s.html'", entrypath);
+
+	len = git_blob_rawsize(blob);
+	if (len <= BLAME_MAXSIZE) {
+		if (!readblamecache(entrypath, &cblob, &chead, &lines, &nlines)) {
+			if (git_oid_equal(&cblob, git_blob_id(blob))) {
+				/* unchanged: keep the page */
+				if (!access(fpath, F_OK)) {
+					free(lines);
+					return;
+				}
+			} else if (blameupdate(ctx, entrypath, &chead, &cblob,
+			                       git_blob_id(blob), &lines, &nlines)) {
+				free(lines);
+				lines = NULL;
+			}
+		}
+		if (!lines && blamefull(ctx, entrypath, &lines, &nlines))
+			lines = NULL;
+		if (lines)
+			writeblamecache(entrypath, git_blob_id(blob), lines, nlines);
+	}
+
+	if (mkpagedir(fpath, tmp, sizeof(tmp))) {
+		free(lines);
+		return;
+	}
+	ctx->relpath = tmp;
+
+	fp = pageopen(fpath);
+	writeheader(fp, ctx->relpath, filename);
+	fputs("<div class=\"container\"><p>", fp);
+	xmlencode(fp, filename, strlen(filename));
+	fputs(" <span class=\"desc\">(blame)</span></p></div>", fp);
+	if (!lines) {
+		if (len > BLAME_MAXSIZE)
+			fputs("<p>File too large for blame.</p>\n", fp);
+		else
+			fputs("<p>Blame failed.</p>\n", fp);
+	} else {
+		if (compact)
+			fprintf(fp, "<pre id=\"blob\" class=\"compact\"%s>\n", compactclick);
+		else
+			fputs("<pre id=\"blob\">\n", fp);
+		memset(&none, 0, sizeof(none));
+		for (i = 0, n = 0, prev = 0; i < len; i++) {
+			if (s[i] != '\n' && i + 1 < len)
+				continue;
+			/* the commit on the first line of each run */
+			if (n >= nlines || git_oid_equal(&lines[n], &none)) {
+				fputs("        ", fp);
+			} else if (n == 0 || !git_oid_equal(&lines[n], &lines[n - 1])) {
+				git_oid_tostr(oid, sizeof(oid), &lines[n]);
+				fprintf(fp, "<a href=\"%scommit/%s.html\">%.7s</a> ", ctx->relpath, oid, oid);
+			} else {
+				fputs("        ", fp);
+			}
+			n++;
+			printlineno(fp, n);
+			xmlencodeline(fp, &s[prev], i - prev + 1);
+			putc('\n', fp);
+			prev = i + 1;
+		}
+		fputs("</pre>\n", fp);
+	}
+	writefooter(fp);
+	pageclose(fp, fpath);
+	free(lines);
+
+	ctx->relpath = "";
+}
+
+void
+putu16(FILE *fp, unsigned int v)
+{
+	putc(v & 0xff, fp);
+	putc((v >> 8) & 0xff, fp);
+}
+
+void
+putu32(FILE *fp, uint32_t v)
+{
+	putc(v & 0xff, fp);
+	putc((v >> 8) & 0xff, fp);
+	putc((v >> 16) & 0xff, fp);
+	putc((v >> 24) & 0xff, fp);
+}
+
+int
+getu16(FILE *fp, unsigned int *v)
+{
+	int a, b;
+
+	if ((a = getc(fp)) == EOF || (b = getc(fp)) == EOF)
+		return -1;
+	*v = a | (b << 8);
+	return 0;
+}
+
+int
+getu32(FILE *fp, uint32_t *v)
+{
+	int a, b, c, d;
+
+	if ((a = getc(fp)) == EOF || (b = getc(fp)) == EOF ||
+	    (c = getc(fp)) == EOF || (d = getc(fp)) == EOF)
+		return -1;
+	*v = (uint32_t)a | ((uint32_t)b << 8) | ((uint32_t)c << 16) | ((uint32_t)d << 24);
+	return 0;
+}
+
+int
+u32cmp(const void *v1, const void *v2)
+{
+	uint32_t a = *(const uint32_t *)v1, b = *(const uint32_t *)v2;
+
+	return a < b ? -1 : a > b;
+}
+
+/* Sorted unique trigrams of the text, case-insensitive for ASCII and with
+   whitespace folded to a space. */
+void
+trigrams(const char *s, size_t len, uint32_t **tri, size_t *ntri)
+{
+	static unsigned char seen[(1 << 24) / 8];
+	unsigned char c;
+	uint32_t t = 0, *out = NULL;
+	size_t i, n = 0, cap = 0, k = 0;
+
+	for (i = 0; i < len; i++) {
+		c = s[i];
+		if (c >= 'A' && c <= 'Z')
+			c |= 0x20;
+		else if (c == '\n' || c == '\r' || c == '\t')
+			c = ' ';
+		t = ((t << 8) | c) & 0xffffff;
+		if (++k < 3 || (seen[t >> 3] & (1 << (t & 7))))
+			continue;
+		seen[t >> 3] |= 1 << (t & 7);
+		if (n == cap && !(out = reallocarray(out, (cap = cap ? cap * 2 : 256), sizeof(*out))))
+			err(1, "realloc");
+		out[n++] = t;
+	}
+	for (i = 0; i < n; i++)
+		seen[out[i] >> 3] = 0;
+	qsort(out, n, sizeof(*out), u32cmp);
+
+	*tri = out;
+	*ntri = n;
+}
+
+struct searchdoc *
+prevdoc_get(int type, const git_oid *id)
+{
+	size_t i;
+
+	if (!prevdoctabcap)
+		return NULL;
+	for (i = fnv1a(FNV1A_INIT, id->id, sizeof(id->id)) & (prevdoctabcap - 1);
+	     prevdoctab[i]; i = (i + 1) & (prevdoctabcap - 1)) {
+		if (prevdocs[prevdoctab[i] - 1].type == type &&
+		    git_oid_equal(&prevdocs[prevdoctab[i] - 1].id, id))
+			return &prevdocs[prevdoctab[i] - 1];
+	}
+	return NULL;
+}
+
+/* Load the documents of the previous run. Each record is: type, object id,
+   u16 length and URL, u16 length and label, u32 count and the trigrams. */
+void
+loadsearchstate(void)
+{
+	struct searchdoc *d;
+	FILE *fp;
+	unsigned int n;
+	uint32_t ntri, k;
+	size_t i;
+	int c;
+
+	if (!(fp = fopen(searchstate, "r")))
+		return;
+	while ((c = getc(fp)) != EOF) {
+		if (!(prevdocs = reallocarray(prevdocs, nprevdocs + 1, sizeof(*prevdocs))))
+			err(1, "realloc");
+		d = &prevdocs[nprevdocs];
+		memset(d, 0, sizeof(*d));
+		d->type = c;
+		if (fread(d->id.id, 1, sizeof(d->id.id), fp) != sizeof(d->id.id) ||
+		    getu16(fp, &n) || !(d->url = calloc(1, n + 1)) ||
+		    fread(d->url, 1, n, fp) != n ||
+		    getu16(fp, &n) || !(d->label = calloc(1, n + 1)) ||
+		    fread(d->label, 1, n, fp) != n || getu32(fp, &ntri))
+			break;
+		if (!(d->tri = reallocarray(NULL, ntri ? ntri : 1, sizeof(uint32_t))))
+			err(1, "realloc");
+		for (k = 0; k < ntri && !getu32(fp, &d->tri[k]); k++)
+			;
+		if (k != ntri)
+			break;
+		d->ntri = ntri;
+		nprevdocs++;
+	}
+	/* truncated file: drop the partial record */
+	if (c != EOF) {
+		free(prevdocs[nprevdocs].url);
+		free(prevdocs[nprevdocs].label);
+		free(prevdocs[nprevdocs].tri);
+	}
+	checkfileerror(fp, searchstate, 'r');
+	fclose(fp);
+
+	for (prevdoctabcap = 1024; prevdoctabcap < nprevdocs * 2; prevdoctabcap *= 2)
+		;
+	if (!(prevdoctab = calloc(prevdoctabcap, sizeof(*prevdoctab))))
+		err(1, "calloc");
+	for (i = 0; i < nprevdocs; i++) {
+		if (prevdoc_get(prevdocs[i].type, &prevdocs[i].id))
+			continue;
+		for (c = fnv1a(FNV1A_INIT, prevdocs[i].id.id, sizeof(prevdocs[i].id.id)) & (prevdoctabcap - 1);
+		     prevdoctab[c]; c = (c + 1) & (prevdoctabcap - 1))
+			;
+		prevdoctab[c] = i + 1;
+	}
+}
+
+/* Add a document, the trigrams of an unchanged object are reused. */
+void
+addsearchdoc(int type, const git_oid *id, const char *url, const char *label,
+             const char *text, size_t len)
+{
+	struct searchdoc *d, *prev;
+
+	if (!(searchdocs = reallocarray(searchdocs, nsearchdocs + 1, sizeof(*searchdocs))))
+		err(1, "realloc");
+	d = &searchdocs[nsearchdocs++];
+	memset(d, 0, sizeof(*d));
+	d->type = type;
+	d->id = *id;
+	if (!(d->url = strdup(url)) || !(d->label = strdup(label)))
+		err(1, "strdup");
+	if ((prev = prevdoc_get(type, id))) {
+		if (!(d->tri = reallocarray(NULL, prev->ntri ? prev->ntri : 1, sizeof(uint32_t))))
+			err(1, "realloc");
+		memcpy(d->tri, prev->tri, prev->ntri * sizeof(uint32_t));
+		d->ntri = prev->ntri;
+	} else if (text) {
+		trigrams(text, len, &(d->tri), &(d->ntri));
+	}
+}
+
+/* Add the text file id to the search index. Its content is only read when
+   its trigrams are not known, from blob or looked up when it is NULL. */
+void
+searchblob(struct renderctx *ctx, const git_oid *id, const char *entrypath,
+           const git_blob *blob)
+{
+	git_blob *b = NULL;
+	char *url = NULL;
+	size_t urllen = 0;
+	FILE *fp;
+
+	if (!prevdoc_get('F', id) && !blob) {
+		if (git_blob_lookup(&b, ctx->repo, id))
+			return;
+		blob = b;
+	}
+	if (!(fp = open_memstream(&url, &urllen)))
+		err(1, "open_memstream");
+	fputs("file/", fp);
+	percentencode(fp, entrypath, strlen(entrypath));
+	fputs(".html", fp);
+	fclose(fp);
+	if (blob)
+		addsearchdoc('F', id, url, entrypath,
+		             git_blob_rawcontent(blob), git_blob_rawsize(blob));
+	else
+		addsearchdoc('F', id, url, entrypath, NULL, 0);
+	free(url);
+	git_blob_free(b);
+}
+
+void
+searchfile(struct renderctx *ctx, git_object *obj, const char *entrypath)
+{
+	const git_blob *blob = (git_blob *)obj;
+
+	if (git_blob_is_binary(blob) || git_blob_rawsize(blob) > SEARCH_MAXSIZE)
+		return;
+	searchblob(ctx, git_blob_id(blob), entrypath,
+	           prevdoc_get('F', git_blob_id(blob)) ? NULL : blob);
+}
+
+struct posting {
+	uint32_t tri;
+	uint32_t doc;
+};
+
+int
+postingcmp(const void *v1, const void *v2)
+{
+	const struct posting *a = v1, *b = v2;
+
+	if (a->tri != b->tri)
+		return a->tri < b->tri ? -1 : 1;
+	return a->doc < b->doc ? -1 : a->doc > b->doc;
+}
+
+void
+putvarint(FILE *fp, uint32_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		putc((v & 0x7f) | 0x80, fp);
+	putc(v, fp);
+}
+
+/* Add the commits of HEAD, write the new state and search.idx:
+   "STGS", u32 version, u32 documents, u32 trigrams, then per document the
+   type, u16 length and URL, u16 length and label, then per trigram the u32
+   trigram, u32 offset and u32 count of its postings, then the postings as
+   varints of the difference to the previous document number. */
+void
+writesearch(struct renderctx *ctx, const git_oid *head)
+{
+	struct searchdoc *d;
+	struct posting *p = NULL;
+	git_revwalk *w = NULL;
+	git_commit *commit;
+	git_oid id;
+	char oidstr[GIT_OID_HEXSZ + 1], url[64], *post = NULL;
+	char tmppath[64] = ".stagit-search.XXXXXXXXXXXX", tmppage[PATH_MAX];
+	const char *summary, *msg;
+	size_t i, j, k, np = 0, ntri = 0, postlen = 0;
+	uint32_t prevdoc;
+	FILE *fp, *pfp;
+	int fd;
+
+	if (head && !git_revwalk_new(&w, ctx->repo) && !git_revwalk_push(w, head)) {
+		while (!git_revwalk_next(&id, w)) {
+			git_oid_tostr(oidstr, sizeof(oidstr), &id);
+			snprintf(url, sizeof(url), "commit/%s.html", oidstr);
+			if ((d = prevdoc_get('C', &id))) {
+				addsearchdoc('C', &id, url, d->label, NULL, 0);
+			} else if (!git_commit_lookup(&commit, ctx->repo, &id)) {
+				summary = git_commit_summary(commit);
+				msg = git_commit_message(commit);
+				addsearchdoc('C', &id, url, summary ? summary : "",
+				             msg ? msg : "", msg ? strlen(msg) : 0);
+				git_commit_free(commit);
+			}
+		}
+	}
+	git_revwalk_free(w);
+
+	/* state for the next run */
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	for (i = 0; i < nsearchdocs; i++) {
+		d = &searchdocs[i];
+		putc(d->type, fp);
+		fwrite(d->id.id, 1, sizeof(d->id.id), fp);
+		putu16(fp, strlen(d->url) & 0xffff);
+		fwrite(d->url, 1, strlen(d->url) & 0xffff, fp);
+		putu16(fp, strlen(d->label) & 0xffff);
+		fwrite(d->label, 1, strlen(d->label) & 0xffff, fp);
+		putu32(fp, d->ntri);
+		for (j = 0; j < d->ntri; j++)
+			putu32(fp, d->tri[j]);
+	}
+	checkfileerror(fp, tmppath, 'w');
+	fclose(fp);
+	if (rename(tmppath, searchstate))
+		err(1, "rename: '%s' to '%s'", tmppath, searchstate);
+
+	/* invert: postings grouped by trigram */
+	for (i = 0; i < nsearchdocs; i++)
+		np += searchdocs[i].ntri;
+	if (np && !(p = reallocarray(NULL, np, sizeof(*p))))
+		err(1, "realloc");
+	for (i = 0, k = 0; i < nsearchdocs; i++) {
+		for (j = 0; j < searchdocs[i].ntri; j++, k++) {
+			p[k].tri = searchdocs[i].tri[j];
+			p[k].doc = i;
+		}
+	}
+	qsort(p, np, sizeof(*p), postingcmp);
+	for (i = 0; i < np; i++)
+		if (!i || p[i].tri != p[i - 1].tri)
+			ntri++;
+
+	fp = tmpfopen("search.idx", tmppage, sizeof(tmppage));
+	fputs("STGS", fp);
+	putu32(fp, 1);
+	putu32(fp, nsearchdocs);
+	putu32(fp, ntri);
+	for (i = 0; i < nsearchdocs; i++) {
+		d = &searchdocs[i];
+		putc(d->type, fp);
+		putu16(fp, strlen(d->url) & 0xffff);
+		fwrite(d->url, 1, strlen(d->url) & 0xffff, fp);
+		putu16(fp, strlen(d->label) & 0xffff);
+		fwrite(d->label, 1, strlen(d->label) & 0xffff, fp);
+	}
+	if (!(pfp = open_memstream(&post, &postlen)))
+		err(1, "open_memstream");
+	for (i = 0; i < np; i = j) {
+		putu32(fp, p[i].tri);
+		fflush(pfp);
+		putu32(fp, postlen);
+		for (j = i, prevdoc = 0; j < np && p[j].tri == p[i].tri; j++) {
+			putvarint(pfp, p[j].doc - prevdoc);
+			prevdoc = p[j].doc;
+		}
+		putu32(fp, j - i);
+	}
+	checkfileerror(pfp, "postings", 'w');
+	fclose(pfp);
+	fwrite(post, 1, postlen, fp);
+	tmpfclose(fp, tmppage, "search.idx");
+	free(post);
+	free(p);
+
+	/* query page, see assets/search.js */
+	ctx->relpath = "";
+	fp = tmpfopen("search.html", tmppage, sizeof(tmppage));
+	writeheader(fp, ctx->relpath, "Search");
+	fputs("<div class=\"container\"><form id=\"search\"><input id=\"q\" type=\"search\" "
+	      "placeholder=\"Search files and commits\" autofocus></form></div>\n"
+	      "<table id=\"log\"><tbody id=\"results\"></tbody></table>\n"
+	      "<script src=\"/assets/search.js\"></script>\n", fp);
+	writefooter(fp);
+	tmpfclose(fp, tmppage, "search.html");
+
+	for (i = 0; i < nsearchdocs; i++) {
+		free(searchdocs[i].url);
+		free(searchdocs[i].label);
+		free(searchdocs[i].tri);
+	}
+	free(searchdocs);
+	for (i = 0; i < nprevdocs; i++) {
+		free(prevdocs[i].url);
+		free(prevdocs[i].label);
+		free(prevdocs[i].tri);
+	}
+	free(prevdocs);
+	free(prevdoctab);
+}
+
+int
+manifestcmp(const void *v1, const void *v2)
+{
+	return strcmp(((const struct manifestent *)v1)->path,
+	              ((const struct manifestent *)v2)->path);
+}
+
+/* Collect the files below dir, the state of stagit (dotfiles) is skipped. */
+void
+manifestscan(const char *dir, struct manifestent **ents, size_t *n)
+{
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX];
+	DIR *d;
+
+	if (!(d = opendir(dir)))
+		err(1, "opendir: '%s'", dir);
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (!strcmp(dir, "."))
+			joinpath(path, sizeof(path), "", de->d_name);
+		else
+			joinpath(path, sizeof(path), dir, de->d_name);
+		if (lstat(path, &st))
+			err(1, "lstat: '%s'", path);
+		if (S_ISDIR(st.st_mode)) {
+			manifestscan(path, ents, n);
+		} else if (S_ISREG(st.st_mode)) {
+			if (!(*ents = reallocarray(*ents, *n + 1, sizeof(**ents))))
+				err(1, "realloc");
+			if (!((*ents)[*n].path = strdup(path)))
+				err(1, "strdup");
+			(*ents)[*n].size = st.st_size;
+			(*ents)[*n].mtime = st.st_mtim;
+			(*n)++;
+		}
+	}
+	closedir(d);
+}
+
+/* Read a manifest: per line the blob id of the content, the size, the
+   modification time and the path. */
+void
+readmanifest(struct manifestent **ents, size_t *n)
+{
+	char *line = NULL, *p, *path;
+	size_t linesiz = 0;
+	ssize_t linelen;
+	long long sec, nsec;
+	FILE *fp;
+
+	if (!(fp = fopen(manifestfile, "r")))
+		return;
+	while ((linelen = getline(&line, &linesiz, fp)) > 0) {
+		if (line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen < GIT_OID_HEXSZ + 1 || line[GIT_OID_HEXSZ] != ' ')
+			continue;
+		line[GIT_OID_HEXSZ] = '\0';
+		if (!(*ents = reallocarray(*ents, *n + 1, sizeof(**ents))))
+			err(1, "realloc");
+		if (git_oid_fromstr(&(*ents)[*n].hash, line) ||
+		    sscanf(line + GIT_OID_HEXSZ + 1, "%lld %lld.%lld", &(*ents)[*n].size, &sec, &nsec) != 3 ||
+		    !(p = strchr(line + GIT_OID_HEXSZ + 1, ' ')) ||
+		    !(path = strchr(p + 1, ' ')))
+			continue;
+		(*ents)[*n].mtime.tv_sec = sec;
+		(*ents)[*n].mtime.tv_nsec = nsec;
+		if (!((*ents)[*n].path = strdup(path + 1)))
+			err(1, "strdup");
+		(*n)++;
+	}
+	checkfileerror(fp, manifestfile, 'r');
+	fclose(fp);
+	qsort(*ents, *n, sizeof(**ents), manifestcmp);
+}
+
+/* Write the manifest of the output directory and the files which were added
+   (A), changed (M) or removed (D) since the previous one. A file with the
+   same size and modification time keeps its previous hash, only written
+   files are read. */
+void
+writemanifest(void)
+{
+	struct manifestent *cur = NULL, *prev = NULL;
+	size_t ncur = 0, nprev = 0, i, j;
+	char tmppath[64] = ".stagit-manifest.XXXXXXXXXXXX", hash[GIT_OID_HEXSZ + 1];
+	char ctmppath[PATH_MAX];
+	FILE *fp, *cfp;
+	int fd, c;
+
+	readmanifest(&prev, &nprev);
+	manifestscan(".", &cur, &ncur);
+	qsort(cur, ncur, sizeof(*cur), manifestcmp);
+
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	cfp = tmpfopen(changesfile, ctmppath, sizeof(ctmppath));
+	for (i = 0, j = 0; i < ncur || j < nprev; ) {
+		if (i == ncur)
+			c = 1;
+		else if (j == nprev)
+			c = -1;
+		else
+			c = strcmp(cur[i].path, prev[j].path);
+		if (c > 0) {
+			fprintf(cfp, "D %s\n", prev[j++].path);
+			continue;
+		}
+		if (c == 0 && cur[i].size == prev[j].size &&
+		    cur[i].mtime.tv_sec == prev[j].mtime.tv_sec &&
+		    cur[i].mtime.tv_nsec == prev[j].mtime.tv_nsec) {
+			cur[i].hash = prev[j].hash;
+		} else {
+			if (git_odb_hashfile(&cur[i].hash, cur[i].path, GIT_OBJ_BLOB))
+				errx(1, "hash: '%s'", cur[i].path);
+			if (c < 0)
+				fprintf(cfp, "A %s\n", cur[i].path);
+			else if (!git_oid_equal(&cur[i].hash, &prev[j].hash))
+				fprintf(cfp, "M %s\n", cur[i].path);
+		}
+		git_oid_tostr(hash, sizeof(hash), &cur[i].hash);
+		fprintf(fp, "%s %lld %lld.%09ld %s\n", hash, cur[i].size,
+		        (long long)cur[i].mtime.tv_sec, (long)cur[i].mtime.tv_nsec,
+		        cur[i].path);
+		i++;
+		if (c == 0)
+			j++;
+	}
+	tmpfclose(cfp, ctmppath, changesfile);
+	checkfileerror(fp, tmppath, 'w');
+	fclose(fp);
+	if (rename(tmppath, manifestfile))
+		err(1, "rename: '%s' to '%s'", tmppath, manifestfile);
+
+	for (i = 0; i < ncur; i++)
+		free(cur[i].path);
+	for (j = 0; j < nprev; j++)
+		free(prev[j].path);
+	free(cur);
+	free(prev);
+}
+
+#ifdef HAVE_SYNCFS
+void
+syncpath(const char *path)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		err(1, "open: '%s'", path);
+	if (syncfs(fd) == -1)
+		err(1, "syncfs: '%s'", path);
+	close(fd);
+}
+#endif
+
+/* Flush everything written to disk with one call per filesystem instead of
+   a fsync() per file: the output directory and the cache file, content cache
+   and bundle, which may be on other filesystems. */
+void
+syncoutput(void)
+{
+#ifdef HAVE_SYNCFS
+	syncpath(".");
+	if (cachefile && !access(cachefile, F_OK))
+		syncpath(cachefile);
+	if (contentcache && !access(contentcache, F_OK))
+		syncpath(contentcache);
+	if (bundlefile && !access(bundlefile, F_OK))
+		syncpath(bundlefile);
+#else
+	sync();
+#endif
+}
+
+/* After the sync replace the generation marker: "<number> <HEAD>". A reader
+   which sees a new marker sees all pages written before it. */
+void
+writegeneration(const git_oid *head)
+{
+	char tmppath[64] = ".stagit-generation.XXXXXXXXXXXX", oid[GIT_OID_HEXSZ + 1] = "";
+	unsigned long long gen = 0;
+	FILE *fp;
+	int fd;
+
+	syncoutput();
+
+	if ((fp = fopen(generationfile, "r"))) {
+		if (fscanf(fp, "%llu", &gen) != 1)
+			gen = 0;
+		fclose(fp);
+	}
+	if (head)
+		git_oid_tostr(oid, sizeof(oid), head);
+
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	fprintf(fp, "%llu %s\n", gen + 1, oid);
+	checkfileerror(fp, tmppath, 'w');
+	if (fsync(fd) == -1)
+		err(1, "fsync: '%s'", tmppath);
+	fclose(fp);
+	if (rename(tmppath, generationfile))
+		err(1, "rename: '%s' to '%s'", tmppath, generationfile);
+	/* the rename itself */
+	if ((fd = open(".", O_RDONLY)) == -1)
+		err(1, "open: .");
+	if (fsync(fd) == -1)
+		err(1, "fsync: .");
+	close(fd);
+}
+
+/* Remove the pages of a file which is no longer in HEAD. */
+void
+removepages(const char *path)
+{
+	const char *dirs[] = { "file", "blame", "history", "render" };
+	char page[PATH_MAX];
+	size_t i;
 	int r;
 
-	git_revwalk_new(&w, repo);
-	git_revwalk_push(w, oid);
+	for (i = 0; i < LEN(dirs); i++) {
+		r = snprintf(page, sizeof(page), "%s/%s.html", dirs[i], path);
+		if (r < 0 || (size_t)r >= sizeof(page))
+			continue;
+		if (unlink(page) == -1 && errno != ENOENT)
+			warn("unlink: '%s'", page);
+	}
+}
+
+int
+committree(const git_oid *id, git_tree **tree)
+{
+	git_commit *commit = NULL;
+	int r;
+
+	if (git_commit_lookup(&commit, repo, id))
+		return -1;
+	r = git_commit_tree(tree, commit);
+	git_commit_free(commit);
+	return r;
+}
+
+/* Remove a directory with its contents, a missing one is not an error. */
+void
+removetree(const char *dir)
+{
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX];
+	DIR *d;
+
+	if (!(d = opendir(dir))) {
+		if (errno != ENOENT)
+			warn("opendir: '%s'", dir);
+		return;
+	}
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		joinpath(path, sizeof(path), dir, de->d_name);
+		if (!lstat(path, &st) && S_ISDIR(st.st_mode))
+			removetree(path);
+		else if (unlink(path) == -1)
+			warn("unlink: '%s'", path);
+	}
+	closedir(d);
+	if (rmdir(dir) == -1)
+		warn("rmdir: '%s'", dir);
+}
 
+/* The cached commit is no longer in the history of HEAD after a force-push.
+   The log walk stops at the merge base instead and the cached log lines and
+   pages of the commits only reachable from the old commit are dropped.
+   Without a merge base the cache is not used. */
+void
+divergecache(const git_oid *head)
+{
+	git_revwalk *w = NULL;
+	git_oid base, id;
+	char oid[GIT_OID_HEXSZ + 1], path[PATH_MAX];
+
+	if (git_merge_base(&base, repo, head, &lastoid)) {
+		fclose(rcachefp);
+		rcachefp = NULL;
+		memset(&lastoid, 0, sizeof(lastoid));
+		lastoidstr[0] = '\0';
+		return;
+	}
+	if (git_revwalk_new(&w, repo) || git_revwalk_push(w, &lastoid) ||
+	    git_revwalk_hide(w, &base))
+		errx(1, "%s: cannot walk the dropped commits", cachefile);
 	while (!git_revwalk_next(&id, w)) {
-		relpath = "";
+		git_oid_tostr(oid, sizeof(oid), &id);
+		pathset_add(&droppedcommits, oid);
+		commitset_del(&id);
+		snprintf(path, sizeof(path), "commit/%s.html", oid);
+		if (unlink(path) == -1 && errno != ENOENT)
+			warn("unlink: '%s'", path);
+		snprintf(path, sizeof(path), "commit/%s", oid);
+		removetree(path);
+	}
+	git_revwalk_free(w);
 
-		if (cachefile && !memcmp(&id, &lastoid, sizeof(id)))
-			break;
+	lastoid = base;
+	git_oid_tostr(lastoidstr, sizeof(lastoidstr), &base);
+	strlcat(lastoidstr, "\n", sizeof(lastoidstr));
+}
 
-		git_oid_tostr(oidstr, sizeof(oidstr), &id);
-		r = snprintf(path, sizeof(path), "commit/%s.html", oidstr);
-		if (r < 0 || (size_t)r >= sizeof(path))
-			errx(1, "path truncated: 'commit/%s.html'", oidstr);
-		r = access(path, F_OK);
+int
+addtreepath(const char *root, const git_tree_entry *entry, void *payload)
+{
+	char path[PATH_MAX];
 
-		/* optimization: if there are no log lines to write and
-		   the commit file already exists: skip the diffstat */
-		if (!nlogcommits) {
-			remcommits++;
-			if (!r)
+	if (git_tree_entry_type(entry) == GIT_OBJ_BLOB) {
+		joinpath(path, sizeof(path), root, git_tree_entry_name(entry));
+		pathset_add(payload, path);
+	}
+	return 0;
+}
+
+/* Remove the pages below dir whose path is not a file in HEAD. prefix is the
+   path of dir below the top directory of the pages. */
+void
+collectpages(const char *dir, const char *prefix, const struct pathset *paths)
+{
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX], rel[PATH_MAX];
+	size_t len;
+	DIR *d;
+
+	if (!(d = opendir(dir)))
+		return;
+	while ((de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		joinpath(path, sizeof(path), dir, de->d_name);
+		joinpath(rel, sizeof(rel), prefix, de->d_name);
+		if (lstat(path, &st))
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			collectpages(path, rel, paths);
+			rmdir(path); /* only when it became empty */
+			continue;
+		}
+		len = strlen(rel);
+		if (len > 5 && !strcmp(rel + len - 5, ".html")) {
+			rel[len - 5] = '\0';
+			if (pathset_has(paths, rel))
 				continue;
 		}
+		if (unlink(path) == -1)
+			warn("unlink: '%s'", path);
+	}
+	closedir(d);
+}
 
-		if (!(ci = commitinfo_getbyoid(&id)))
-			break;
-		/* diffstat: for stagit HTML required for the log.html line */
-		if (commitinfo_getstats(ci) == -1)
-			goto err;
+/* Remove the pages of commits which are not reachable from HEAD or any
+   branch or tag and the pages of files which are not in HEAD. */
+/* Remove the cached blame of the files which are not in HEAD, the path is
+   on the first line of each entry. Partial entries of a failed run too. */
+void
+collectblamecache(const struct pathset *paths)
+{
+	struct dirent *de;
+	char path[PATH_MAX], buf[PATH_MAX + 2];
+	FILE *fp;
+	DIR *d;
+	int keep;
 
-		if (nlogcommits != 0) {
-			writelogline(fp, ci);
-			if (nlogcommits > 0)
-				nlogcommits--;
+	if (!(d = opendir(blamecachedir)))
+		return;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		joinpath(path, sizeof(path), blamecachedir, de->d_name);
+		keep = 0;
+		if (!strchr(de->d_name, '.') && (fp = fopen(path, "r"))) {
+			if (fgets(buf, sizeof(buf), fp)) {
+				buf[strcspn(buf, "\n")] = '\0';
+				keep = pathset_has(paths, buf);
+			}
+			fclose(fp);
 		}
+		if (!keep && unlink(path) == -1)
+			warn("unlink: '%s'", path);
+	}
+	closedir(d);
+}
 
-		if (cachefile)
-			writelogline(wcachefp, ci);
+void
+collectgarbage(const git_oid *head)
+{
+	const char *dirs[] = { "file", "blame", "history", "render" };
+	struct pathset commits = { 0 }, paths = { 0 };
+	struct dirent *de;
+	git_revwalk *w = NULL;
+	git_tree *tree = NULL;
+	git_oid id;
+	char oid[GIT_OID_HEXSZ + 1], path[PATH_MAX];
+	size_t i;
+	DIR *d;
 
-		/* check if file exists if so skip it */
-		if (r) {
-			relpath = "../";
-			fpfile = efopen(path, "w");
-			writeheader(fpfile, ci->summary);
-			fputs("<div class=\"container\"><table id=\"container\"><tr><td>", fpfile);
-			printshowfile(fpfile, ci);
-			fputs("</pre></td></tr></table></div>\n", fpfile);
-			writefooter(fpfile);
-			checkfileerror(fpfile, path, 'w');
-			fclose(fpfile);
-		}
-err:
-		commitinfo_free(ci);
+	if (!head || git_revwalk_new(&w, repo) || git_revwalk_push(w, head) ||
+	    git_revwalk_push_glob(w, "refs/heads") || git_revwalk_push_glob(w, "refs/tags"))
+		errx(1, "cannot walk the reachable commits");
+	while (!git_revwalk_next(&id, w)) {
+		git_oid_tostr(oid, sizeof(oid), &id);
+		pathset_add(&commits, oid);
 	}
 	git_revwalk_free(w);
 
-	if (nlogcommits == 0 && remcommits != 0) {
-		fprintf(fp, "<tr><td></td><td colspan=\"5\">"
-		        "%zu more commits remaining, fetch the repository"
-		        "</td></tr>\n", remcommits);
+	/* commit/<oid>.html and the directory of a split commit */
+	if ((d = opendir("commit"))) {
+		while ((de = readdir(d))) {
+			if (strlen(de->d_name) < GIT_OID_HEXSZ || de->d_name[0] == '.')
+				continue;
+			memcpy(oid, de->d_name, GIT_OID_HEXSZ);
+			oid[GIT_OID_HEXSZ] = '\0';
+			if (pathset_has(&commits, oid))
+				continue;
+			joinpath(path, sizeof(path), "commit", de->d_name);
+			if (!strcmp(de->d_name + GIT_OID_HEXSZ, ".html")) {
+				if (unlink(path) == -1)
+					warn("unlink: '%s'", path);
+				if (!git_oid_fromstr(&id, oid))
+					commitset_del(&id);
+			} else if (!de->d_name[GIT_OID_HEXSZ]) {
+				removetree(path);
+			}
+		}
+		closedir(d);
 	}
 
-	relpath = "";
+	if (committree(head, &tree))
+		errx(1, "cannot read the tree of HEAD");
+	git_tree_walk(tree, GIT_TREEWALK_PRE, addtreepath, &paths);
+	git_tree_free(tree);
+	for (i = 0; i < LEN(dirs); i++)
+		collectpages(dirs[i], "", &paths);
+	collectblamecache(&paths);
+
+	for (i = 0; i < commits.cap; i++)
+		free(commits.slots[i]);
+	free(commits.slots);
+	for (i = 0; i < paths.cap; i++)
+		free(paths.slots[i]);
+	free(paths.slots);
+}
+
+/* Read the "<old> <new> <ref>" lines of a post-receive hook from stdin. When
+   the branch of HEAD was updated the paths changed between its old and new
+   tree are collected, a created branch or an unknown tree renders all files. */
+void
+readupdates(const git_oid *head)
+{
+	git_reference *ref = NULL;
+	git_tree *oldtree = NULL, *newtree = NULL;
+	git_revwalk *w = NULL;
+	git_diff *diff = NULL;
+	git_diff_options opts;
+	const git_diff_delta *delta;
+	const char *headref = NULL;
+	char *line = NULL;
+	size_t linesiz = 0, i;
+	ssize_t linelen;
+	git_oid oldid, newid, id;
+	char oid[GIT_OID_HEXSZ + 1];
+	int full = 0;
 
-	return 0;
+	if (!git_reference_lookup(&ref, repo, "HEAD") &&
+	    git_reference_type(ref) == GIT_REF_SYMBOLIC)
+		headref = git_reference_symbolic_target(ref);
+
+	git_diff_init_options(&opts, GIT_DIFF_OPTIONS_VERSION);
+	while ((linelen = getline(&line, &linesiz, stdin)) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strlen(line) < GIT_OID_HEXSZ * 2 + 3 ||
+		    line[GIT_OID_HEXSZ] != ' ' || line[GIT_OID_HEXSZ * 2 + 1] != ' ')
+			errx(1, "stdin: invalid update: '%s'", line);
+		line[GIT_OID_HEXSZ] = line[GIT_OID_HEXSZ * 2 + 1] = '\0';
+		if (git_oid_fromstr(&oldid, line) ||
+		    git_oid_fromstr(&newid, line + GIT_OID_HEXSZ + 1))
+			errx(1, "stdin: invalid object id");
+		/* a detached HEAD is updated when it is the new commit */
+		if (headref ? strcmp(line + GIT_OID_HEXSZ * 2 + 2, headref) :
+		    !head || !git_oid_equal(&newid, head))
+			continue;
+		headupdated = 1;
+		if (!git_oid_iszero(&oldid)) {
+			headold = oldid;
+			hasheadold = 1;
+		}
+
+		if (git_oid_iszero(&oldid) || git_oid_iszero(&newid) ||
+		    committree(&oldid, &oldtree) || committree(&newid, &newtree) ||
+		    git_diff_tree_to_tree(&diff, repo, oldtree, newtree, &opts)) {
+			full = 1;
+		} else {
+			/* a path changed and reverted within the push is not in
+			   the tree diff but gets new history rows */
+			if (filehist && !git_revwalk_new(&w, repo)) {
+				if (!git_revwalk_push(w, &newid) && !git_revwalk_hide(w, &oldid)) {
+					while (!git_revwalk_next(&id, w)) {
+						git_oid_tostr(oid, sizeof(oid), &id);
+						pathset_add(&newcommits, oid);
+					}
+				}
+				git_revwalk_free(w);
+				w = NULL;
+			}
+			for (i = 0; i < git_diff_num_deltas(diff); i++) {
+				delta = git_diff_get_delta(diff, i);
+				pathset_add(&changedpaths, delta->new_file.path);
+				if (delta->status == GIT_DELTA_DELETED)
+					removepages(delta->old_file.path);
+			}
+		}
+		git_diff_free(diff);
+		git_tree_free(oldtree);
+		git_tree_free(newtree);
+		diff = NULL;
+		oldtree = newtree = NULL;
+	}
+	if (ferror(stdin))
+		err(1, "getline: stdin");
+	free(line);
+	git_reference_free(ref);
+
+	haschanged = headupdated && !full;
 }
 
+/* Write the tar header of a file, a pax header holds a path which does not fit
+   in the ustar name and prefix fields. */
 void
-printcommitatom(FILE *fp, struct commitinfo *ci, const char *tag)
+tarheader(FILE *fp, const char *path, long long size, long long mtime, int type)
 {
-	fputs("<entry>\n", fp);
+	unsigned char h[512];
+	char rec[PATH_MAX + 32];
+	const char *name = path, *slash;
+	size_t len = strlen(path), i, n;
+	unsigned int sum = 0;
+	int r;
 
-	fprintf(fp, "<id>%s</id>\n", ci->oid);
-	if (ci->author) {
-		fputs("<published>", fp);
-		printtimez(fp, &(ci->author->when));
-		fputs("</published>\n", fp);
+	memset(h, 0, sizeof(h));
+	if (len > 100) {
+		/* split at a '/' into prefix (155) and name (100) */
+		for (slash = path + len; slash > path && (*slash != '/' ||
+		     (size_t)(slash - path) > 155 || len - (slash - path) - 1 > 100); slash--)
+			;
+		if (slash > path) {
+			memcpy(h + 345, path, slash - path);
+			name = slash + 1;
+		} else if (type != 'x') {
+			/* "<length> path=<path>\n", the length includes itself */
+			for (n = len + 8; (size_t)(r = snprintf(rec, sizeof(rec),
+			     "%zu path=%s\n", n, path)) != n; n = r)
+				;
+			tarheader(fp, "PaxHeader", r, mtime, 'x');
+			fwrite(rec, 1, r, fp);
+			memset(h, 0, sizeof(h));
+			fwrite(h, 1, (512 - r % 512) % 512, fp);
+			name = path + len - 100;
+		}
 	}
-	if (ci->committer) {
-		fputs("<updated>", fp);
-		printtimez(fp, &(ci->committer->when));
-		fputs("</updated>\n", fp);
+	memcpy(h, name, strlen(name) < 100 ? strlen(name) : 100);
+	snprintf((char *)h + 100, 8, "%07o", 0644);
+	snprintf((char *)h + 108, 8, "%07o", 0);
+	snprintf((char *)h + 116, 8, "%07o", 0);
+	snprintf((char *)h + 124, 12, "%011llo", size);
+	snprintf((char *)h + 136, 12, "%011llo", mtime > 0 ? mtime : 0);
+	memset(h + 148, ' ', 8);
+	h[156] = type;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+	for (i = 0; i < sizeof(h); i++)
+		sum += h[i];
+	snprintf((char *)h + 148, 8, "%06o", sum);
+	fwrite(h, 1, sizeof(h), fp);
+}
+
+/* Append a file of the output directory, returns the offset of its data. */
+long long
+bundleappend(FILE *fp, const struct manifestent *e)
+{
+	char buf[BUFSIZ], zero[512] = { 0 };
+	long long offset, total = 0;
+	FILE *in;
+	size_t n;
+
+	tarheader(fp, e->path, e->size, e->mtime.tv_sec, '0');
+	offset = ftello(fp);
+	in = efopen(e->path, "r");
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+		fwrite(buf, 1, n, fp);
+		total += n;
 	}
-	if (ci->summary) {
-		fputs("<title>", fp);
-		if (tag && tag[0]) {
-			fputs("[", fp);
-			xmlencode(fp, tag, strlen(tag));
-			fputs("] ", fp);
+	checkfileerror(in, e->path, 'r');
+	fclose(in);
+	if (total != e->size)
+		errx(1, "bundle: '%s' changed while writing", e->path);
+	fwrite(zero, 1, (512 - total % 512) % 512, fp);
+
+	return offset;
+}
+
+/* Index of the bundle: "stagit-bundle 1 <end>" where <end> is the offset of
+   the end-of-archive blocks, then per line the offset of the data, the size,
+   the hash and the path, sorted by path. Returns the end or -1. */
+long long
+readbundleindex(const char *path, struct bundleent **ents, size_t *n)
+{
+	char *line = NULL, hash[GIT_OID_HEXSZ + 1];
+	size_t linesiz = 0;
+	ssize_t linelen;
+	long long end = -1;
+	struct bundleent *e;
+	FILE *fp;
+	int off;
+
+	if (!(fp = fopen(path, "r")))
+		return -1;
+	if (getline(&line, &linesiz, fp) <= 0 ||
+	    sscanf(line, "stagit-bundle 1 %lld", &end) != 1)
+		end = -1;
+	while (end != -1 && (linelen = getline(&line, &linesiz, fp)) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!(*ents = reallocarray(*ents, *n + 1, sizeof(**ents))))
+			err(1, "realloc");
+		e = &(*ents)[*n];
+		if (sscanf(line, "%lld %lld %40s %n", &e->offset, &e->size, hash, &off) != 3 ||
+		    git_oid_fromstr(&e->hash, hash)) {
+			end = -1;
+			break;
 		}
-		xmlencode(fp, ci->summary, strlen(ci->summary));
-		fputs("</title>\n", fp);
+		if (!(e->path = strdup(line + off)))
+			err(1, "strdup");
+		(*n)++;
 	}
-	fprintf(fp, "<link rel=\"alternate\" type=\"text/html\" href=\"%scommit/%s.html\" />\n",
-	        baseurl, ci->oid);
+	checkfileerror(fp, path, 'r');
+	fclose(fp);
+	free(line);
 
-	if (ci-> author) {
-		fputs("<author>\n<name>", fp);
-		xmlencode(fp, ci->author->name, strlen(ci->author->name));
-		fputs("</name>\n<email>", fp);
-		xmlencode(fp, ci->author->email, strlen(ci->author->email));
-		fputs("</email>\n</author>\n", fp);
+	return end;
+}
+
+/* Update the bundle from the manifest: files with the same hash keep their
+   data in the bundle, others are appended. Removed files only leave the
+   index. When more than half of the bundle is stale it is written again. */
+void
+writebundle(void)
+{
+	struct manifestent *cur = NULL;
+	struct bundleent *old = NULL, *ents;
+	char idxpath[PATH_MAX], idxtmp[PATH_MAX], tmppath[PATH_MAX], zero[1024] = { 0 };
+	char hash[GIT_OID_HEXSZ + 1];
+	size_t ncur = 0, nold = 0, nkeep, i, j;
+	long long end, live = 0;
+	FILE *fp;
+	int fd, r, full;
+
+	r = snprintf(idxpath, sizeof(idxpath), "%s.idx", bundlefile);
+	if (r < 0 || (size_t)r >= sizeof(idxpath))
+		errx(1, "path truncated: '%s.idx'", bundlefile);
+
+	readmanifest(&cur, &ncur);
+	if (!(ents = calloc(ncur ? ncur : 1, sizeof(*ents))))
+		err(1, "calloc");
+	end = readbundleindex(idxpath, &old, &nold);
+	for (i = 0; i < nold; i++)
+		live += old[i].size + 512;
+	full = end < 0 || end > live * 2 + 1024 * 1024 ||
+	       !(fp = fopen(bundlefile, "r+"));
+	nkeep = nold;
+
+	if (full) {
+		r = snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", bundlefile);
+		if (r < 0 || (size_t)r >= sizeof(tmppath))
+			errx(1, "path truncated: '%s.XXXXXX'", bundlefile);
+		if ((fd = mkstemp(tmppath)) == -1)
+			err(1, "mkstemp");
+		if (!(fp = fdopen(fd, "w")))
+			err(1, "fdopen: '%s'", tmppath);
+		nkeep = 0;
+	} else if (fseeko(fp, end, SEEK_SET)) {
+		err(1, "fseeko: '%s'", bundlefile);
 	}
 
-	fputs("<content>", fp);
-	fprintf(fp, "commit %s\n", ci->oid);
-	if (ci->parentoid[0])
-		fprintf(fp, "parent %s\n", ci->parentoid);
-	if (ci->author) {
-		fputs("Author: ", fp);
-		xmlencode(fp, ci->author->name, strlen(ci->author->name));
-		fputs(" &lt;", fp);
-		xmlencode(fp, ci->author->email, strlen(ci->author->email));
-		fputs("&gt;\nDate:   ", fp);
-		printtime(fp, &(ci->author->when));
-		putc('\n', fp);
+	/* both are sorted by path */
+	for (i = 0, j = 0; i < ncur; i++) {
+		while (j < nkeep && strcmp(old[j].path, cur[i].path) < 0)
+			j++;
+		ents[i].path = cur[i].path;
+		ents[i].size = cur[i].size;
+		ents[i].hash = cur[i].hash;
+		if (j < nkeep && !strcmp(old[j].path, cur[i].path) &&
+		    git_oid_equal(&old[j].hash, &cur[i].hash))
+			ents[i].offset = old[j].offset;
+		else
+			ents[i].offset = bundleappend(fp, &cur[i]);
 	}
-	if (ci->msg) {
-		putc('\n', fp);
-		xmlencode(fp, ci->msg, strlen(ci->msg));
+	end = ftello(fp);
+	fwrite(zero, 1, sizeof(zero), fp);
+	checkfileerror(fp, bundlefile, 'w');
+	if (ftruncate(fileno(fp), end + sizeof(zero)) == -1)
+		err(1, "ftruncate: '%s'", bundlefile);
+	fclose(fp);
+	if (full && rename(tmppath, bundlefile))
+		err(1, "rename: '%s' to '%s'", tmppath, bundlefile);
+
+	r = snprintf(idxtmp, sizeof(idxtmp), "%s.XXXXXX", idxpath);
+	if (r < 0 || (size_t)r >= sizeof(idxtmp))
+		errx(1, "path truncated: '%s.XXXXXX'", idxpath);
+	if ((fd = mkstemp(idxtmp)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", idxtmp);
+	fprintf(fp, "stagit-bundle 1 %lld\n", end);
+	for (i = 0; i < ncur; i++) {
+		git_oid_tostr(hash, sizeof(hash), &ents[i].hash);
+		fprintf(fp, "%lld %lld %s %s\n", ents[i].offset, ents[i].size,
+		        hash, ents[i].path);
 	}
-	fputs("\n</content>\n</entry>\n", fp);
+	checkfileerror(fp, idxtmp, 'w');
+	fclose(fp);
+	if (rename(idxtmp, idxpath))
+		err(1, "rename: '%s' to '%s'", idxtmp, idxpath);
+
+	for (i = 0; i < ncur; i++)
+		free(cur[i].path);
+	for (i = 0; i < nold; i++)
+		free(old[i].path);
+	free(cur);
+	free(old);
+	free(ents);
 }
 
-int
-writeatom(FILE *fp, int all)
+void
+process_output_md(const char* text, unsigned int size, void* fp)
 {
-	struct referenceinfo *ris = NULL;
-	size_t refcount = 0;
-	struct commitinfo *ci;
-	git_revwalk *w = NULL;
-	git_oid id;
-	size_t i, m = 100; /* last 'm' commits */
+	fwrite(text, 1, size, (FILE *)fp);
+}
 
-	fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-	      "<feed xmlns=\"http://www.w3.org/2005/Atom\">\n<title>", fp);
-	xmlencode(fp, strippedname, strlen(strippedname));
-	fputs(", branch HEAD</title>\n<subtitle>", fp);
-	xmlencode(fp, description, strlen(description));
-	fputs("</subtitle>\n", fp);
+/* Render the Markdown blob to HTML, reusing the cached rendering of the
+   same blob id if there is one. */
+void
+rendermd(const git_blob *blob, char **html, size_t *htmllen)
+{
+	FILE *fp;
 
-	/* all commits or only tags? */
-	if (all) {
-		git_revwalk_new(&w, repo);
-		git_revwalk_push_head(w);
-		for (i = 0; i < m && !git_revwalk_next(&id, w); i++) {
-			if (!(ci = commitinfo_getbyoid(&id)))
-				break;
-			printcommitatom(fp, ci, "");
-			commitinfo_free(ci);
-		}
-		git_revwalk_free(w);
-	} else if (getrefs(&ris, &refcount) != -1) {
-		/* references: tags */
-		for (i = 0; i < refcount; i++) {
-			if (git_reference_is_tag(ris[i].ref))
-				printcommitatom(fp, ris[i].ci,
-				                git_reference_shorthand(ris[i].ref));
+	if (!readcontentcache(git_blob_id(blob), ".md", html, htmllen))
+		return;
+
+	if (!(fp = open_memstream(html, htmllen)))
+		err(1, "open_memstream");
+	if (md_html(git_blob_rawcontent(blob), git_blob_rawsize(blob),
+	    process_output_md, fp, MD_FLAG_TABLES | MD_FLAG_TASKLISTS |
+	    MD_FLAG_PERMISSIVEEMAILAUTOLINKS | MD_FLAG_PERMISSIVEURLAUTOLINKS, 0))
+		fprintf(stderr, "Error parsing markdown\n");
+	checkfileerror(fp, "markdown", 'w');
+	fclose(fp);
+
+	writecontentcache(git_blob_id(blob), ".md", *html, *htmllen);
+}
+
+void
+addmdjob(git_object *obj, const char *entrypath, const char *name)
+{
+	struct mdjob *job;
+	char path[PATH_MAX];
+	int r;
+
+	r = snprintf(path, sizeof(path), "render/%s.html", entrypath);
+	if (r < 0 || (size_t)r >= sizeof(path))
+		errx(1, "path truncated: 'render/%s.html'", entrypath);
+
+	if (!(mdjobs = reallocarray(mdjobs, nmdjobs + 1, sizeof(*mdjobs))))
+		err(1, "realloc");
+	job = &mdjobs[nmdjobs++];
+	memset(job, 0, sizeof(*job));
+	job->blob = (git_blob *)obj;
+	if (!(job->path = strdup(path)) || !(job->name = strdup(name)))
+		err(1, "strdup");
+}
+
+void *
+mdworker(void *arg)
+{
+	struct mdjob *job;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&mdjobmtx);
+		job = mdjobnext < nmdjobs ? &mdjobs[mdjobnext++] : NULL;
+		pthread_mutex_unlock(&mdjobmtx);
+		if (!job)
+			break;
+		rendermd(job->blob, &(job->html), &(job->htmllen));
+	}
+
+	return NULL;
+}
+
+/* Render the queued Markdown files with a thread per CPU and write their
+   pages, the pages themselves are written from the main thread only. */
+void
+writemdpages(struct renderctx *ctx)
+{
+	pthread_t threads[16];
+	struct mdjob *job;
+	char tmp[PATH_MAX];
+	long ncpu;
+	size_t i, nthreads;
+	FILE *fp;
 
-			commitinfo_free(ris[i].ci);
-			git_reference_free(ris[i].ref);
+	if (!nmdjobs)
+		return;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu > 0 ? (size_t)ncpu : 1;
+	if (nthreads > LEN(threads))
+		nthreads = LEN(threads);
+	if (nthreads > nmdjobs)
+		nthreads = nmdjobs;
+
+	mdjobnext = 0;
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, mdworker, NULL))
+			errx(1, "pthread_create");
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < nmdjobs; i++) {
+		job = &mdjobs[i];
+		if (!mkpagedir(job->path, tmp, sizeof(tmp))) {
+			ctx->relpath = tmp;
+			fp = pageopen(job->path);
+			writeheader(fp, ctx->relpath, job->name);
+			fputs("<div class=\"md\">", fp);
+			fwrite(job->html, 1, job->htmllen, fp);
+			fputs("</div>\n", fp);
+			writefooter(fp);
+			pageclose(fp, job->path);
 		}
-		free(ris);
+		git_blob_free(job->blob);
+		free(job->path);
+		free(job->name);
+		free(job->html);
 	}
+	free(mdjobs);
+	mdjobs = NULL;
+	nmdjobs = 0;
+	ctx->relpath = "";
+}
 
-	fputs("</feed>\n", fp);
+/* Handle i of the repository pool, opened on first use from the main
+   thread. */
+git_repository *
+repopool_get(size_t i)
+{
+	if (!repopool[i] && git_repository_open_ext(&repopool[i], repodir,
+	    GIT_REPOSITORY_OPEN_NO_SEARCH, NULL) < 0)
+		errx(1, "%s: cannot open repository", repodir);
+	return repopool[i];
+}
 
-	return 0;
+void
+addblamejob(git_object *obj, const char *entrypath, const char *name)
+{
+	struct blamejob *job;
+
+	if (git_blob_is_binary((git_blob *)obj))
+		return;
+	if (!(blamejobs = reallocarray(blamejobs, nblamejobs + 1, sizeof(*blamejobs))))
+		err(1, "realloc");
+	job = &blamejobs[nblamejobs++];
+	job->id = *git_object_id(obj);
+	if (!(job->path = strdup(entrypath)) || !(job->name = strdup(name)))
+		err(1, "strdup");
 }
 
-size_t
-writeblob(git_object *obj, const char *fpath, const char *filename, size_t filesize)
+void *
+blameworker(void *arg)
 {
-	char tmp[PATH_MAX] = "", *d;
-	const char *p;
-	size_t lc = 0;
-	FILE *fp;
-
-	if (strlcpy(tmp, fpath, sizeof(tmp)) >= sizeof(tmp))
-		errx(1, "path truncated: '%s'", fpath);
-	if (!(d = dirname(tmp)))
-		err(1, "dirname");
-	if (mkdirp(d))
-		return -1;
-
-	for (p = fpath, tmp[0] = '\0'; *p; p++) {
-		if (*p == '/' && strlcat(tmp, "../", sizeof(tmp)) >= sizeof(tmp))
-			errx(1, "path truncated: '../%s'", tmp);
+	struct renderctx *ctx = arg;
+	struct blamejob *job;
+	git_blob *blob;
+
+	for (;;) {
+		pthread_mutex_lock(&blamejobmtx);
+		job = blamejobnext < nblamejobs ? &blamejobs[blamejobnext++] : NULL;
+		pthread_mutex_unlock(&blamejobmtx);
+		if (!job)
+			break;
+		if (git_blob_lookup(&blob, ctx->repo, &job->id))
+			errx(1, "cannot read the blob of '%s'", job->path);
+		writeblame(ctx, blob, job->path, job->name);
+		git_blob_free(blob);
 	}
-	relpath = tmp;
 
-	fp = efopen(fpath, "w");
-	writeheader(fp, filename);
-	fputs("<div class=\"container\"><p>", fp);
-	xmlencode(fp, filename, strlen(filename));
-	fprintf(fp, " <span class=\"desc\">(%zuB)</span>", filesize);
-	fputs("</p></div>", fp);
+	return NULL;
+}
 
-	if (git_blob_is_binary((git_blob *)obj))
-		fputs("<p>Binary file.</p>\n", fp);
-	else
-		lc = writeblobhtml(fp, (git_blob *)obj);
+/* Write the queued blame pages with a thread per CPU, each renders with its
+   own context and repository handle from the pool. */
+void
+writeblames(void)
+{
+	struct renderctx ctxs[LEN(repopool)];
+	pthread_t threads[LEN(repopool)];
+	long ncpu;
+	size_t i, nthreads;
 
-	writefooter(fp);
-	checkfileerror(fp, fpath, 'w');
-	fclose(fp);
+	if (!nblamejobs)
+		return;
 
-	relpath = "";
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu > 0 ? (size_t)ncpu : 1;
+	if (nthreads > LEN(threads))
+		nthreads = LEN(threads);
+	if (nthreads > nblamejobs)
+		nthreads = nblamejobs;
+
+	blamejobnext = 0;
+	memset(ctxs, 0, sizeof(ctxs));
+	for (i = 0; i < nthreads; i++) {
+		ctxs[i].repo = repopool_get(i);
+		ctxs[i].relpath = "";
+		if (pthread_create(&threads[i], NULL, blameworker, &ctxs[i]))
+			errx(1, "pthread_create");
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		free(ctxs[i].blamerange);
+	}
 
-	return lc;
+	for (i = 0; i < nblamejobs; i++) {
+		free(blamejobs[i].path);
+		free(blamejobs[i].name);
+	}
+	free(blamejobs);
+	blamejobs = NULL;
+	nblamejobs = 0;
 }
 
+/* write the ls(1) style mode of m to mode, which holds 11 bytes */
 const char *
-filemode(git_filemode_t m)
+filemode(git_filemode_t m, char *mode)
 {
-	static char mode[11];
-
-	memset(mode, '-', sizeof(mode) - 1);
+	memset(mode, '-', 10);
 	mode[10] = '\0';
 
 	if (S_ISREG(m))
@@ -977,15 +4866,117 @@ filemode(git_filemode_t m)
 	return mode;
 }
 
+/* Read .stagit-files of the last run. Format: "<blob> <lines> <size>
+   <binary> <path>" for each file in HEAD. */
+void
+loadfilesstate(void)
+{
+	struct fileent *fe;
+	char *line = NULL, *p;
+	size_t linesiz = 0, cap = 0, i, c;
+	ssize_t n;
+	FILE *fp;
+
+	if (!(fp = fopen(filesstate, "r")))
+		return;
+	while ((n = getline(&line, &linesiz, fp)) > 0) {
+		if (line[n - 1] == '\n')
+			line[--n] = '\0';
+		if (n < GIT_OID_HEXSZ + 8 || line[GIT_OID_HEXSZ] != ' ')
+			continue;
+		if (nprevfiles == cap) {
+			cap = cap ? cap * 2 : 1024;
+			if (!(prevfiles = reallocarray(prevfiles, cap, sizeof(*prevfiles))))
+				err(1, "realloc");
+		}
+		fe = &prevfiles[nprevfiles];
+		if (git_oid_fromstrn(&fe->id, line, GIT_OID_HEXSZ))
+			continue;
+		p = line + GIT_OID_HEXSZ + 1;
+		fe->lc = strtoull(p, &p, 10);
+		fe->size = strtoull(p, &p, 10);
+		fe->binary = strtol(p, &p, 10);
+		if (*p != ' ')
+			continue;
+		if (!(fe->path = strdup(p + 1)))
+			err(1, "strdup");
+		nprevfiles++;
+	}
+	free(line);
+	checkfileerror(fp, filesstate, 'r');
+	fclose(fp);
+
+	for (prevfiletabcap = 1024; prevfiletabcap < nprevfiles * 2; prevfiletabcap *= 2)
+		;
+	if (!(prevfiletab = calloc(prevfiletabcap, sizeof(*prevfiletab))))
+		err(1, "calloc");
+	for (i = 0; i < nprevfiles; i++) {
+		for (c = fnv1a(FNV1A_INIT, prevfiles[i].path, strlen(prevfiles[i].path)) &
+		     (prevfiletabcap - 1); prevfiletab[c]; c = (c + 1) & (prevfiletabcap - 1))
+			;
+		prevfiletab[c] = i + 1;
+	}
+}
+
+struct fileent *
+prevfile_get(const char *path)
+{
+	size_t c;
+
+	if (!prevfiletabcap)
+		return NULL;
+	for (c = fnv1a(FNV1A_INIT, path, strlen(path)) & (prevfiletabcap - 1);
+	     prevfiletab[c]; c = (c + 1) & (prevfiletabcap - 1)) {
+		if (!strcmp(prevfiles[prevfiletab[c] - 1].path, path))
+			return &prevfiles[prevfiletab[c] - 1];
+	}
+	return NULL;
+}
+
+void
+writefileent(const char *path, const git_oid *id, size_t lc, size_t size,
+             int binary)
+{
+	char oid[GIT_OID_HEXSZ + 1];
+
+	if (strchr(path, '\n'))
+		return;
+	git_oid_tostr(oid, sizeof(oid), id);
+	fprintf(wfilesfp, "%s %zu %zu %d %s\n", oid, lc, size, binary, path);
+}
+
+void
+writefilerow(struct renderctx *ctx, FILE *fp, const git_tree_entry *entry,
+             const char *filepath, const char *entrypath, size_t lc,
+             size_t filesize)
+{
+	char mode[11];
+
+	fputs("<tr><td>", fp);
+	fputs(filemode(git_tree_entry_filemode(entry), mode), fp);
+	fprintf(fp, "</td><td><a href=\"%s", ctx->relpath);
+	percentencode(fp, filepath, strlen(filepath));
+	fputs("\">", fp);
+	xmlencode(fp, entrypath, strlen(entrypath));
+	fputs("</a></td><td class=\"num\">", fp);
+	if (lc > 0)
+		fprintf(fp, "%zuL", lc);
+	else
+		fprintf(fp, "%zuB", filesize);
+	fputs("</td></tr>\n", fp);
+}
+
 int
-writefilestree(FILE *fp, git_tree *tree, const char *path)
+writefilestree(struct renderctx *ctx, FILE *fp, git_tree *tree, const char *path)
 {
 	const git_tree_entry *entry = NULL;
 	git_object *obj = NULL;
+	struct fileent *fe;
+	git_otype type;
 	const char *entryname;
 	char filepath[PATH_MAX], entrypath[PATH_MAX], oid[8];
 	size_t count, i, lc, filesize;
-	int r, ret;
+	int changed, r, ret;
 
 	count = git_tree_entrycount(tree);
 	for (i = 0; i < count; i++) {
@@ -999,13 +4990,38 @@ writefilestree(FILE *fp, git_tree *tree, const char *path)
 		if (r < 0 || (size_t)r >= sizeof(filepath))
 			errx(1, "path truncated: 'file/%s.html'", entrypath);
 
-		if (!git_tree_entry_to_object(&obj, repo, entry)) {
+		/* -p: the row of a file with the same blob as in the last run,
+		   its pages are kept */
+		if (haschanged && git_tree_entry_type(entry) == GIT_OBJ_BLOB &&
+		    !pathset_has(&changedpaths, entrypath) &&
+		    (fe = prevfile_get(entrypath)) &&
+		    git_oid_equal(&fe->id, git_tree_entry_id(entry))) {
+			if (searchindex && !fe->binary && fe->size <= SEARCH_MAXSIZE)
+				searchblob(ctx, &fe->id, entrypath, NULL);
+			writefilerow(ctx, fp, entry, filepath, entrypath, fe->lc, fe->size);
+			writefileent(entrypath, &fe->id, fe->lc, fe->size, fe->binary);
+			continue;
+		}
+
+		/* --max-memory: a file over the budget is not loaded, its page
+		   only has the size */
+		if (blobmaxsize && git_tree_entry_type(entry) == GIT_OBJ_BLOB &&
+		    !git_odb_read_header(&filesize, &type, budgetodb,
+		    git_tree_entry_id(entry)) && filesize > blobmaxsize) {
+			if (!haschanged || pathset_has(&changedpaths, entrypath) ||
+			    access(filepath, F_OK))
+				writeblob(ctx, NULL, filepath, entryname, filesize);
+			writefilerow(ctx, fp, entry, filepath, entrypath, 0, filesize);
+			continue;
+		}
+
+		if (!git_tree_entry_to_object(&obj, ctx->repo, entry)) {
 			switch (git_object_type(obj)) {
 			case GIT_OBJ_BLOB:
 				break;
 			case GIT_OBJ_TREE:
 				/* NOTE: recurses */
-				ret = writefilestree(fp, (git_tree *)obj,
+				ret = writefilestree(ctx, fp, (git_tree *)obj,
 				                     entrypath);
 				git_object_free(obj);
 				if (ret)
@@ -1017,25 +5033,33 @@ writefilestree(FILE *fp, git_tree *tree, const char *path)
 			}
 
 			filesize = git_blob_rawsize((git_blob *)obj);
-			lc = writeblob(obj, filepath, entryname, filesize);
-
-			fputs("<tr><td>", fp);
-			fputs(filemode(git_tree_entry_filemode(entry)), fp);
-			fprintf(fp, "</td><td><a href=\"%s", relpath);
-			percentencode(fp, filepath, strlen(filepath));
-			fputs("\">", fp);
-			xmlencode(fp, entrypath, strlen(entrypath));
-			fputs("</a></td><td class=\"num\">", fp);
-			if (lc > 0)
-				fprintf(fp, "%zuL", lc);
+			changed = !haschanged || pathset_has(&changedpaths, entrypath) ||
+			          access(filepath, F_OK);
+			if (changed) {
+				lc = writeblob(ctx, obj, filepath, entryname, filesize);
+				if (blame)
+					addblamejob(obj, entrypath, entryname);
+			} else if (git_blob_is_binary((git_blob *)obj)) {
+				/* unchanged since the last run: keep its pages */
+				lc = 0;
+			} else {
+				lc = countlines(git_blob_rawcontent((git_blob *)obj), filesize);
+			}
+			if (searchindex)
+				searchfile(ctx, obj, entrypath);
+
+			writefilerow(ctx, fp, entry, filepath, entrypath, lc, filesize);
+			writefileent(entrypath, git_object_id(obj), lc, filesize,
+			             git_blob_is_binary((git_blob *)obj));
+			if (changed && ismarkdown(entryname) &&
+			    !git_blob_is_binary((git_blob *)obj))
+				addmdjob(obj, entrypath, entryname);
 			else
-				fprintf(fp, "%zuB", filesize);
-			fputs("</td></tr>\n", fp);
-			git_object_free(obj);
+				git_object_free(obj);
 		} else if (git_tree_entry_type(entry) == GIT_OBJ_COMMIT) {
 			/* commit object in tree is a submodule */
 			fprintf(fp, "<tr><td>m---------</td><td><a href=\"%sfile/.gitmodules.html\">",
-				relpath);
+				ctx->relpath);
 			xmlencode(fp, entrypath, strlen(entrypath));
 			fputs("</a> @ ", fp);
 			git_oid_tostr(oid, sizeof(oid), git_tree_entry_id(entry));
@@ -1048,42 +5072,54 @@ writefilestree(FILE *fp, git_tree *tree, const char *path)
 }
 
 int
-writefiles(FILE *fp, const git_oid *id)
+writefiles(struct renderctx *ctx, FILE *fp, const git_oid *id)
 {
 	git_tree *tree = NULL;
 	git_commit *commit = NULL;
-	int ret = -1;
+	size_t i;
+	int fd, ret = -1;
+
+	if (haschanged)
+		loadfilesstate();
+	if ((fd = mkstemp(filesstatetmp)) == -1)
+		err(1, "mkstemp");
+	if (!(wfilesfp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", filesstatetmp);
 
 	fputs("<table id=\"files\"><thead>\n<tr>"
 	      "<td><b>Mode</b></td><td><b>Name</b></td>"
 	      "<td class=\"num\"><b>Size</b></td>"
 	      "</tr>\n</thead><tbody>\n", fp);
 
-	if (!git_commit_lookup(&commit, repo, id) &&
+	if (!git_commit_lookup(&commit, ctx->repo, id) &&
 	    !git_commit_tree(&tree, commit))
-		ret = writefilestree(fp, tree, "");
+		ret = writefilestree(ctx, fp, tree, "");
 
 	fputs("</tbody></table>", fp);
 
+	checkfileerror(wfilesfp, filesstatetmp, 'w');
+	fclose(wfilesfp);
+	wfilesfp = NULL;
+	for (i = 0; i < nprevfiles; i++)
+		free(prevfiles[i].path);
+	free(prevfiles);
+	free(prevfiletab);
+
 	git_commit_free(commit);
 	git_tree_free(tree);
 
 	return ret;
 }
 
-int
-writerefs(FILE *fp)
+void
+writerefs(FILE *fp, const struct referenceinfo *ris, size_t refcount)
 {
-	struct referenceinfo *ris = NULL;
 	struct commitinfo *ci;
-	size_t count, i, j, refcount;
+	size_t count, i, j;
 	const char *titles[] = { "Branches", "Tags" };
 	const char *ids[] = { "branches", "tags" };
 	const char *s;
 
-	if (getrefs(&ris, &refcount) == -1)
-		return -1;
-
 	for (i = 0, j = 0, count = 0; i < refcount; i++) {
 		if (j == 0 && git_reference_is_tag(ris[i].ref)) {
 			if (count)
@@ -1109,7 +5145,7 @@ writerefs(FILE *fp)
 		xmlencode(fp, s, strlen(s));
 		fputs("</td><td>", fp);
 		if (ci->author)
-			printtimeshort(fp, &(ci->author->when));
+			printtimeshort(&mainctx, fp, &(ci->author->when));
 		fputs("</td><td>", fp);
 		if (ci->author)
 			xmlencode(fp, ci->author->name, strlen(ci->author->name));
@@ -1118,28 +5154,387 @@ writerefs(FILE *fp)
 	/* table footer */
 	if (count)
 		fputs("</tbody></table><br/>\n", fp);
+}
 
-	for (i = 0; i < refcount; i++) {
-		commitinfo_free(ris[i].ci);
-		git_reference_free(ris[i].ref);
+int
+readrefscache(const char *key, char **refs, size_t *refslen,
+              char **tags, size_t *tagslen)
+{
+	FILE *fp;
+	char line[128], ckey[64];
+	int ret = -1;
+
+	if (!(fp = fopen(refscachefile, "r")))
+		return -1;
+	if (!fgets(line, sizeof(line), fp) ||
+	    sscanf(line, "%63s %zu %zu", ckey, refslen, tagslen) != 3 ||
+	    strcmp(ckey, key))
+		goto end;
+
+	if (!(*refs = malloc(*refslen + 1)) || !(*tags = malloc(*tagslen + 1)))
+		err(1, "malloc");
+	if (fread(*refs, 1, *refslen, fp) == *refslen &&
+	    fread(*tags, 1, *tagslen, fp) == *tagslen) {
+		ret = 0;
+	} else {
+		free(*refs);
+		free(*tags);
+		*refs = *tags = NULL;
 	}
-	free(ris);
+end:
+	checkfileerror(fp, refscachefile, 'r');
+	fclose(fp);
+
+	return ret;
+}
+
+void
+writerefscache(const char *key, const char *refs, size_t refslen,
+               const char *tags, size_t tagslen)
+{
+	FILE *fp;
+	char tmppath[64] = ".stagit-refs.XXXXXXXXXXXX";
+	int fd;
+
+	if ((fd = mkstemp(tmppath)) == -1)
+		err(1, "mkstemp");
+	if (!(fp = fdopen(fd, "w")))
+		err(1, "fdopen: '%s'", tmppath);
+	fprintf(fp, "%s %zu %zu\n", key, refslen, tagslen);
+	fwrite(refs, 1, refslen, fp);
+	fwrite(tags, 1, tagslen, fp);
+	checkfileerror(fp, tmppath, 'w');
+	fclose(fp);
+	if (rename(tmppath, refscachefile))
+		err(1, "rename: '%s' to '%s'", tmppath, refscachefile);
+}
+
+/* Render the refs.html table and tags.xml entries from one reference
+   snapshot, or reuse them from the previous run if no ref changed. */
+int
+getrefspages(char **refs, size_t *refslen, char **tags, size_t *tagslen)
+{
+	struct referenceinfo *ris = NULL;
+	size_t refcount = 0;
+	FILE *fprefs, *fptags;
+	char key[64];
+	int haskey;
+
+	*refs = *tags = NULL;
+	*refslen = *tagslen = 0;
+
+	haskey = !getrefskey(key, sizeof(key));
+	if (haskey && !readrefscache(key, refs, refslen, tags, tagslen))
+		return 0;
+
+	if (getrefs(&ris, &refcount) == -1)
+		return -1;
+
+	if (!(fprefs = open_memstream(refs, refslen)) ||
+	    !(fptags = open_memstream(tags, tagslen)))
+		err(1, "open_memstream");
+	writerefs(fprefs, ris, refcount);
+	writeatomtags(fptags, ris, refcount);
+	freerefs(ris, refcount);
+	checkfileerror(fprefs, "refs", 'w');
+	checkfileerror(fptags, "tags", 'w');
+	fclose(fprefs);
+	fclose(fptags);
+
+	if (haskey)
+		writerefscache(key, *refs, *refslen, *tags, *tagslen);
 
 	return 0;
 }
 
+/* Keep the EST_TOP largest items, sorted by size. */
 void
-usage(char *argv0)
+esttop(struct estitem *top, long long size, const char *name)
 {
-	fprintf(stderr, "usage: %s [-c cachefile | -l commits] "
-	        "[-u baseurl] repodir\n", argv0);
-	exit(1);
+	size_t i;
+
+	if (size <= top[EST_TOP - 1].size)
+		return;
+	free(top[EST_TOP - 1].name);
+	for (i = EST_TOP - 1; i > 0 && top[i - 1].size < size; i--)
+		top[i] = top[i - 1];
+	top[i].size = size;
+	if (!(top[i].name = strdup(name)))
+		err(1, "strdup");
+}
+
+/* Likely binary by the suffix, only the object headers are read. */
+int
+estbinary(const char *path)
+{
+	const char *exts[] = {
+		".png", ".jpg", ".jpeg", ".gif", ".ico", ".pdf", ".zip", ".gz",
+		".xz", ".bz2", ".tar", ".tgz", ".woff", ".woff2", ".ttf", ".otf",
+		".exe", ".dll", ".so", ".a", ".o", ".jar", ".class", ".mp3",
+		".mp4", ".webp", ".bin"
+	};
+	size_t i, n, len = strlen(path);
+
+	for (i = 0; i < LEN(exts); i++) {
+		n = strlen(exts[i]);
+		if (len > n && !strcasecmp(path + len - n, exts[i]))
+			return 1;
+	}
+	return 0;
+}
+
+long long
+estblobsize(git_odb *odb, const git_oid *id)
+{
+	git_otype type;
+	size_t size;
+
+	if (git_oid_iszero(id) || git_odb_read_header(&size, &type, odb, id))
+		return 0;
+	return size;
+}
+
+struct estfiles {
+	git_odb *odb;
+	struct estitem *top;
+	struct estitem *topbinary;
+	size_t pages;
+	size_t binary;
+	long long bytes;
+};
+
+int
+estfile(const char *root, const git_tree_entry *entry, void *payload)
+{
+	struct estfiles *ef = payload;
+	char path[PATH_MAX];
+	long long size;
+
+	if (git_tree_entry_type(entry) != GIT_OBJ_BLOB)
+		return 0;
+	joinpath(path, sizeof(path), root, git_tree_entry_name(entry));
+	size = estblobsize(ef->odb, git_tree_entry_id(entry));
+	ef->pages++;
+	if (estbinary(path)) {
+		ef->binary++;
+		ef->bytes += EST_PAGE;
+		esttop(ef->topbinary, size, path);
+	} else {
+		ef->bytes += EST_PAGE + size + (size / EST_LINELEN + 1) * EST_LINE;
+	}
+	esttop(ef->top, size, path);
+	return 0;
 }
 
+/* Report the pages a run would write and their estimated size without
+   rendering: the history is walked with tree diffs and the sizes of the
+   changed blobs are read from the object headers. Added and removed files
+   count as their size, modified files as the difference plus some context. */
 void
-process_output_md(const char* text, unsigned int size, void* fp)
+estimate(const git_oid *head)
+{
+	struct estitem topcommits[EST_TOP] = { { 0 } }, topblobs[EST_TOP] = { { 0 } };
+	struct estitem topsplit[EST_TOP] = { { 0 } }, topbinary[EST_TOP] = { { 0 } };
+	struct estfiles ef = { 0 };
+	const git_diff_delta *delta;
+	git_diff_options opts;
+	git_reference_iterator *it = NULL;
+	git_reference *ref;
+	git_revwalk *w = NULL;
+	git_commit *commit = NULL, *parent = NULL;
+	git_tree *tree = NULL, *ptree = NULL;
+	git_diff *diff = NULL;
+	git_odb *odb = NULL;
+	git_oid id, cached;
+	FILE *fp;
+	char oid[GIT_OID_HEXSZ + 1], line[GIT_OID_HEXSZ + 2];
+	int hascached = 0;
+	size_t ncommits = 0, nsplit = 0, nsplitpages = 0, nbinary = 0, nbranches = 0, ntags = 0;
+	size_t ndeltas, i;
+	long long commitbytes = 0, bytes, oldsize, newsize, lines;
+
+	if (git_repository_odb(&odb, repo))
+		errx(1, "cannot open the object database");
+	git_diff_init_options(&opts, GIT_DIFF_OPTIONS_VERSION);
+	opts.flags |= GIT_DIFF_DISABLE_PATHSPEC_MATCH | GIT_DIFF_IGNORE_SUBMODULES | GIT_DIFF_INCLUDE_TYPECHANGE;
+
+	/* the commits with a page in .stagit-commits or before the -c cached
+	   one are not written again, -l only limits log.html */
+	loadcommitset();
+	if (cachefile && (fp = fopen(cachefile, "r"))) {
+		hascached = fgets(line, sizeof(line), fp) &&
+		            !git_oid_fromstrn(&cached, line, GIT_OID_HEXSZ);
+		fclose(fp);
+	}
+
+	if (head && !git_revwalk_new(&w, repo) && !git_revwalk_push(w, head)) {
+		/* the cached commit may be gone after a force push */
+		if (hascached)
+			git_revwalk_hide(w, &cached);
+		while (!git_revwalk_next(&id, w)) {
+			if (commitset_has(&id))
+				continue;
+			if (git_commit_lookup(&commit, repo, &id) || git_commit_tree(&tree, commit))
+				goto next;
+			if (!git_commit_parent(&parent, commit, 0))
+				git_commit_tree(&ptree, parent);
+			if (git_diff_tree_to_tree(&diff, repo, ptree, tree, &opts))
+				goto next;
+
+			ndeltas = git_diff_num_deltas(diff);
+			bytes = EST_PAGE;
+			lines = 0;
+			for (i = 0; i < ndeltas; i++) {
+				delta = git_diff_get_delta(diff, i);
+				bytes += EST_LINE * 4;
+				if (estbinary(delta->new_file.path)) {
+					nbinary++;
+					continue;
+				}
+				oldsize = estblobsize(odb, &delta->old_file.id);
+				newsize = estblobsize(odb, &delta->new_file.id);
+				if (!oldsize || !newsize)
+					newsize += oldsize;
+				else
+					newsize = llabs(newsize - oldsize) + 6 * EST_LINELEN;
+				lines += newsize / EST_LINELEN;
+				bytes += newsize + (newsize / EST_LINELEN) * EST_LINE;
+			}
+			ncommits++;
+			commitbytes += bytes;
+			git_oid_tostr(oid, sizeof(oid), &id);
+			esttop(topcommits, bytes, oid);
+			/* split into a page per file, see commitinfo_getstats() */
+			if (ndeltas > DIFF_MAXFILES || lines > (long long)diffmaxlines) {
+				nsplit++;
+				nsplitpages += ndeltas < SPLIT_MAXFILES ? ndeltas : SPLIT_MAXFILES;
+				esttop(topsplit, bytes, oid);
+			}
+next:
+			git_diff_free(diff);
+			git_tree_free(ptree);
+			git_tree_free(tree);
+			git_commit_free(parent);
+			git_commit_free(commit);
+			diff = NULL;
+			ptree = tree = NULL;
+			parent = commit = NULL;
+		}
+	}
+	git_revwalk_free(w);
+	free(rendered);
+	free(renderedgone);
+
+	ef.odb = odb;
+	ef.top = topblobs;
+	ef.topbinary = topbinary;
+	if (head && !committree(head, &tree))
+		git_tree_walk(tree, GIT_TREEWALK_PRE, estfile, &ef);
+	git_tree_free(tree);
+
+	if (!git_reference_iterator_new(&it, repo)) {
+		while (!git_reference_next(&ref, it)) {
+			if (git_reference_is_branch(ref))
+				nbranches++;
+			else if (git_reference_is_tag(ref))
+				ntags++;
+			git_reference_free(ref);
+		}
+		git_reference_iterator_free(it);
+	}
+	git_odb_free(odb);
+
+	printf("commit pages: %zu, ~%lld bytes\n", ncommits, commitbytes);
+	printf("split commits: %zu, %zu file diff pages\n", nsplit, nsplitpages);
+	printf("binary diffs: %zu\n", nbinary);
+	printf("file pages: %zu (%zu binary), ~%lld bytes\n", ef.pages, ef.binary, ef.bytes);
+	printf("refs: %zu branches, %zu tags\n", nbranches, ntags);
+	printf("total: ~%lld bytes\n", commitbytes + ef.bytes + (ncommits + 4) * EST_LINE * 4);
+	printf("largest commits:\n");
+	for (i = 0; i < EST_TOP && topcommits[i].name; i++) {
+		printf("\t%s ~%lld bytes\n", topcommits[i].name, topcommits[i].size);
+		free(topcommits[i].name);
+	}
+	printf("largest split commits:\n");
+	for (i = 0; i < EST_TOP && topsplit[i].name; i++) {
+		printf("\t%s ~%lld bytes\n", topsplit[i].name, topsplit[i].size);
+		free(topsplit[i].name);
+	}
+	printf("largest blobs:\n");
+	for (i = 0; i < EST_TOP && topblobs[i].name; i++) {
+		printf("\t%s %lld bytes\n", topblobs[i].name, topblobs[i].size);
+		free(topblobs[i].name);
+	}
+	printf("largest binary files:\n");
+	for (i = 0; i < EST_TOP && topbinary[i].name; i++) {
+		printf("\t%s %lld bytes\n", topbinary[i].name, topbinary[i].size);
+		free(topbinary[i].name);
+	}
+}
+
+/* Parse a positive decimal number, -1 on error. */
+long long
+parsenum(const char *s)
+{
+	long long n;
+	char *p;
+
+	errno = 0;
+	n = strtoll(s, &p, 10);
+	if (s[0] == '\0' || *p != '\0' || n <= 0 || errno)
+		return -1;
+	return n;
+}
+
+/* size in bytes with an optional K, M or G suffix */
+long long
+parsesize(const char *s)
+{
+	long long n, mul = 1;
+	char *p;
+
+	errno = 0;
+	n = strtoll(s, &p, 10);
+	switch (*p) {
+	case 'G': mul *= 1024; /* FALLTHROUGH */
+	case 'M': mul *= 1024; /* FALLTHROUGH */
+	case 'K': mul *= 1024; p++; break;
+	}
+	if (s[0] == '\0' || *p != '\0' || n <= 0 || errno || n > LLONG_MAX / mul)
+		return -1;
+	return n * mul;
+}
+
+size_t
+budgetlimit(size_t limit, long long budget)
+{
+	return (long long)limit < budget ? limit : (size_t)budget;
+}
+
+/* Lower the caches of libgit2 and the limits of what is held in memory at
+   once to fit maxmemory: larger commits are split into a page per file and
+   larger files get a page without content. */
+void
+setbudget(void)
+{
+	git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, (ssize_t)(maxmemory / 8));
+	git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, (size_t)(maxmemory / 16));
+	git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, (size_t)(maxmemory / 4));
+
+	diffmaxlines = budgetlimit(DIFF_MAXLINES, maxmemory / 4 / MEM_DIFFLINE);
+	splitmaxlines = budgetlimit(SPLIT_MAXLINES, maxmemory / 4 / MEM_DIFFLINE);
+	writemaxqueued = budgetlimit(WRITE_MAXQUEUED, maxmemory / 8);
+	/* the file, its lines and the page are in memory at once */
+	blobmaxsize = maxmemory / 16;
+}
+
+void
+usage(char *argv0)
 {
-	fprintf((FILE *)fp, "%.*s", size, text);
+	fprintf(stderr, "usage: %s [--estimate] [--max-memory size] [-c cachefile | -l commits] [-b branch] [-B bundle] "
+	        "[-d cachedir] [-r none | renames | copies | similar] "
+	        "[-R maxdeltas] [-t msec] [-W writers] [-a] [-f] [-g] [-H] [-i] [-m] [-p] [-s] [-S] [-u baseurl] repodir\n", argv0);
+	exit(1);
 }
 
 int
@@ -1147,11 +5542,17 @@ main(int argc, char *argv[])
 {
 	git_object *obj = NULL;
 	const git_oid *head = NULL;
+	struct rusage ru;
+	long long maxrss;
 	mode_t mask;
-	FILE *fp, *fpread;
+	FILE *fp, *fpatom, *fpread;
 	char path[PATH_MAX], repodirabs[PATH_MAX + 1], *p;
 	char tmppath[64] = "cache.XXXXXXXXXXXX", buf[BUFSIZ];
-	size_t n;
+	char tmppage[PATH_MAX], tmpatom[PATH_MAX];
+	char bundledir[PATH_MAX], bundledirabs[PATH_MAX], outdirabs[PATH_MAX];
+	char *refshtml, *tagsxml, *mdhtml, *line = NULL;
+	size_t n, refshtmllen, tagsxmllen, mdhtmllen, linesiz = 0;
+	ssize_t linelen;
 	int i, fd, r;
 
 	for (i = 1; i < argc; i++) {
@@ -1159,6 +5560,12 @@ main(int argc, char *argv[])
 			if (repodir)
 				usage(argv[0]);
 			repodir = argv[i];
+		} else if (!strcmp(argv[i], "--estimate")) {
+			estimateonly = 1;
+		} else if (!strcmp(argv[i], "--max-memory")) {
+			if (i + 1 >= argc || (maxmemory = parsesize(argv[++i])) == -1 ||
+			    maxmemory < 1024 * 1024)
+				usage(argv[0]);
 		} else if (argv[i][1] == 'c') {
 			if (nlogcommits > 0 || i + 1 >= argc)
 				usage(argv[0]);
@@ -1171,10 +5578,70 @@ main(int argc, char *argv[])
 			if (argv[i][0] == '\0' || *p != '\0' ||
 			    nlogcommits <= 0 || errno)
 				usage(argv[0]);
+			nbranchcommits = nlogcommits;
 		} else if (argv[i][1] == 'u') {
 			if (i + 1 >= argc)
 				usage(argv[0]);
 			baseurl = argv[++i];
+		} else if (argv[i][1] == 'r') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			i++;
+			if (!strcmp(argv[i], "none"))
+				findflags = 0;
+			else if (!strcmp(argv[i], "renames"))
+				findflags = GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_EXACT_MATCH_ONLY;
+			else if (!strcmp(argv[i], "copies"))
+				findflags = GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_COPIES |
+				            GIT_DIFF_FIND_EXACT_MATCH_ONLY;
+			else if (!strcmp(argv[i], "similar"))
+				findflags = GIT_DIFF_FIND_RENAMES | GIT_DIFF_FIND_COPIES;
+			else
+				usage(argv[0]);
+		} else if (argv[i][1] == 'R') {
+			if (i + 1 >= argc || (findmaxdeltas = parsenum(argv[++i])) == -1)
+				usage(argv[0]);
+		} else if (argv[i][1] == 't') {
+			if (i + 1 >= argc || (findbudget = parsenum(argv[++i])) == -1)
+				usage(argv[0]);
+		} else if (argv[i][1] == 'a') {
+			blame = 1;
+		} else if (argv[i][1] == 'i') {
+			searchindex = 1;
+		} else if (argv[i][1] == 'b') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			if (!(logbranches = reallocarray(logbranches, nlogbranches + 1,
+			    sizeof(*logbranches))))
+				err(1, "realloc");
+			logbranches[nlogbranches++] = argv[++i];
+		} else if (argv[i][1] == 'B') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			bundlefile = argv[++i];
+			manifest = 1;
+		} else if (argv[i][1] == 'S') {
+			durable = 1;
+		} else if (argv[i][1] == 'W') {
+			if (i + 1 >= argc || (nwriters = parsenum(argv[++i])) == -1)
+				usage(argv[0]);
+			outbackend = &threadbackend;
+		} else if (argv[i][1] == 'g') {
+			collect = 1;
+		} else if (argv[i][1] == 'p') {
+			postreceive = 1;
+		} else if (argv[i][1] == 'H') {
+			syntax = 1;
+		} else if (argv[i][1] == 'm') {
+			manifest = 1;
+		} else if (argv[i][1] == 'f') {
+			filehist = 1;
+		} else if (argv[i][1] == 's') {
+			compact = 1;
+		} else if (argv[i][1] == 'd') {
+			if (i + 1 >= argc)
+				usage(argv[0]);
+			contentcache = argv[++i];
 		}
 	}
 	if (!repodir)
@@ -1182,6 +5649,32 @@ main(int argc, char *argv[])
 
 	if (!realpath(repodir, repodirabs))
 		err(1, "realpath");
+	/* -B: a bundle in the output directory would be in the manifest and be
+	   copied into itself */
+	if (bundlefile) {
+		if (parentdir(bundledir, sizeof(bundledir), bundlefile))
+			errx(1, "path truncated: '%s'", bundlefile);
+		if (!realpath(bundledir, bundledirabs))
+			err(1, "realpath: '%s'", bundledir);
+		if (!realpath(".", outdirabs))
+			err(1, "realpath: .");
+		n = strlen(outdirabs);
+		if (!strncmp(bundledirabs, outdirabs, n) &&
+		    (outdirabs[n - 1] == '/' || bundledirabs[n] == '/' || !bundledirabs[n]))
+			errx(1, "%s: the bundle must be outside the output directory", bundlefile);
+	}
+	/* pages are created with mkstemp(), give them the usual mode */
+	umask((mask = umask(0)));
+	pagemode = (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask;
+	/* files next to the cache, known before unveil() */
+	if (cachefile) {
+		r = snprintf(pathscache, sizeof(pathscache), "%s.paths", cachefile);
+		if (r < 0 || (size_t)r >= sizeof(pathscache))
+			errx(1, "path truncated: '%s.paths'", cachefile);
+		r = snprintf(branchescache, sizeof(branchescache), "%s.branches", cachefile);
+		if (r < 0 || (size_t)r >= sizeof(branchescache))
+			errx(1, "path truncated: '%s.branches'", cachefile);
+	}
 
 	/* do not search outside the git repository:
 	   GIT_CONFIG_LEVEL_APP is the highest level currently */
@@ -1190,6 +5683,8 @@ main(int argc, char *argv[])
 		git_libgit2_opts(GIT_OPT_SET_SEARCH_PATH, i, "");
 	/* do not require the git repository to be owned by the current user */
 	git_libgit2_opts(GIT_OPT_SET_OWNER_VALIDATION, 0);
+	if (maxmemory)
+		setbudget();
 
 #ifdef __OpenBSD__
 	if (unveil(repodir, "r") == -1)
@@ -1198,14 +5693,19 @@ main(int argc, char *argv[])
 		err(1, "unveil: .");
 	if (cachefile && unveil(cachefile, "rwc") == -1)
 		err(1, "unveil: %s", cachefile);
-
-	if (cachefile) {
-		if (pledge("stdio rpath wpath cpath fattr", NULL) == -1)
-			err(1, "pledge");
-	} else {
-		if (pledge("stdio rpath wpath cpath", NULL) == -1)
-			err(1, "pledge");
-	}
+	if (cachefile && filehist && unveil(pathscache, "rwc") == -1)
+		err(1, "unveil: %s", pathscache);
+	if (cachefile && nlogbranches && unveil(branchescache, "rwc") == -1)
+		err(1, "unveil: %s", branchescache);
+	if (contentcache && unveil(contentcache, "rwc") == -1)
+		err(1, "unveil: %s", contentcache);
+	/* the bundle, its index and their temporary files */
+	if (bundlefile && unveil(bundledir, "rwc") == -1)
+		err(1, "unveil: %s", bundledir);
+
+	/* fattr: the mode of the cache file and the temporary pages */
+	if (pledge("stdio rpath wpath cpath fattr", NULL) == -1)
+		err(1, "pledge");
 #endif
 
 	if (git_repository_open_ext(&repo, repodir,
@@ -1213,11 +5713,31 @@ main(int argc, char *argv[])
 		fprintf(stderr, "%s: cannot open repository\n", argv[0]);
 		return 1;
 	}
+	if (maxmemory && git_repository_odb(&budgetodb, repo))
+		errx(1, "git_repository_odb");
+	mainctx.repo = repo;
+	mainctx.relpath = "";
 
 	/* find HEAD */
 	if (!git_revparse_single(&obj, repo, "HEAD"))
 		head = git_object_id(obj);
 	git_object_free(obj);
+	blamehead = head;
+
+	if (estimateonly) {
+		estimate(head);
+		git_repository_free(repo);
+		git_libgit2_shutdown();
+		return 0;
+	}
+
+	loadcommitset();
+
+	if (postreceive)
+		readupdates(head);
+
+	if (outbackend)
+		outbackend->start();
 
 	/* use directory name as name */
 	if ((name = strrchr(repodirabs, '/')))
@@ -1283,120 +5803,225 @@ main(int argc, char *argv[])
 
 	/* README page */
 	if (readme) {
-		fp = efopen("README.html", "w");
-		writeheader(fp, "README");
+		fp = tmpfopen("README.html", tmppage, sizeof(tmppage));
+		writeheader(fp, mainctx.relpath, "README");
 		git_revparse_single(&obj, repo, readmefiles[r]);
 		const char *s = git_blob_rawcontent((git_blob *)obj);
 		if (r == 1) {
-			git_off_t len = git_blob_rawsize((git_blob *)obj);
+			rendermd((git_blob *)obj, &mdhtml, &mdhtmllen);
 			fputs("<div class=\"md\">", fp);
-			if (md_html(s, len, process_output_md, fp, MD_FLAG_TABLES | MD_FLAG_TASKLISTS |
-			    MD_FLAG_PERMISSIVEEMAILAUTOLINKS | MD_FLAG_PERMISSIVEURLAUTOLINKS, 0))
-				fprintf(stderr, "Error parsing markdown\n");
+			fwrite(mdhtml, 1, mdhtmllen, fp);
 			fputs("</div>\n", fp);
+			free(mdhtml);
 		} else {
 			fputs("<pre id=\"readme\">", fp);
 			xmlencode(fp, s, strlen(s));
 			fputs("</pre>\n", fp);
 		}
 		writefooter(fp);
-		fclose(fp);
+		tmpfclose(fp, tmppage, "README.html");
+		git_object_free(obj);
 	}
 
-	/* log for HEAD */
-	fp = efopen("log.html", "w");
-	relpath = "";
-	mkdir("commit", S_IRWXU | S_IRWXG | S_IRWXO);
-	writeheader(fp, "Log");
-	fputs("<table id=\"log\"><thead>\n<tr><td><b>Date</b></td><td><b>Commit message</b></td>"
-	      "<td class=\"num\"><b>Files</b></td><td class=\"num\"><b>+</b></td>"
-	      "<td class=\"num\"><b>-</b></td></tr>\n</thead><tbody>\n", fp);
+	/* with -p the pages of HEAD are only written when its branch changed */
+	if (!postreceive || headupdated) {
+		/* log and Atom feed for HEAD, written from the same history walk */
+		fpatom = tmpfopen("atom.xml", tmpatom, sizeof(tmpatom));
+		writeatomheader(fpatom);
+		fp = tmpfopen("log.html", tmppage, sizeof(tmppage));
+		mainctx.relpath = "";
+		mkdir("commit", S_IRWXU | S_IRWXG | S_IRWXO);
+		writeheader(fp, mainctx.relpath, "Log");
+		fputs("<table id=\"log\"><thead>\n<tr><td><b>Date</b></td><td><b>Commit message</b></td>"
+		      "<td class=\"num\"><b>Files</b></td><td class=\"num\"><b>+</b></td>"
+		      "<td class=\"num\"><b>-</b></td></tr>\n</thead><tbody>\n", fp);
+
+		if (cachefile && head) {
+			/* read from cache file (does not need to exist) */
+			if ((rcachefp = fopen(cachefile, "r"))) {
+				if (!fgets(lastoidstr, sizeof(lastoidstr), rcachefp))
+					errx(1, "%s: no object id", cachefile);
+				if (git_oid_fromstr(&lastoid, lastoidstr))
+					errx(1, "%s: invalid object id", cachefile);
+				if (!git_oid_equal(&lastoid, head) &&
+				    git_graph_descendant_of(repo, head, &lastoid) != 1)
+					divergecache(head);
+			}
 
-	if (cachefile && head) {
-		/* read from cache file (does not need to exist) */
-		if ((rcachefp = fopen(cachefile, "r"))) {
-			if (!fgets(lastoidstr, sizeof(lastoidstr), rcachefp))
-				errx(1, "%s: no object id", cachefile);
-			if (git_oid_fromstr(&lastoid, lastoidstr))
-				errx(1, "%s: invalid object id", cachefile);
+			/* write log to (temporary) cache */
+			if ((fd = mkstemp(tmppath)) == -1)
+				err(1, "mkstemp");
+			if (!(wcachefp = fdopen(fd, "w")))
+				err(1, "fdopen: '%s'", tmppath);
+			/* write last commit id (HEAD) */
+			git_oid_tostr(buf, sizeof(buf), head);
+			fprintf(wcachefp, "%s\n", buf);
+
+			if (filehist)
+				openpathscache(head);
+
+			writelog(&mainctx, fp, fpatom, head);
+
+			if (filehist)
+				closepathscache();
+
+			if (rcachefp && droppedcommits.n) {
+				/* append previous log without the dropped commits */
+				while ((linelen = getline(&line, &linesiz, rcachefp)) > 0) {
+					if ((p = strstr(line, "commit/")) &&
+					    strlen(p + strlen("commit/")) > GIT_OID_HEXSZ) {
+						memcpy(buf, p + strlen("commit/"), GIT_OID_HEXSZ);
+						buf[GIT_OID_HEXSZ] = '\0';
+						if (pathset_has(&droppedcommits, buf))
+							continue;
+					}
+					if (fwrite(line, 1, linelen, fp) != (size_t)linelen ||
+					    fwrite(line, 1, linelen, wcachefp) != (size_t)linelen)
+						break;
+				}
+				free(line);
+				checkfileerror(rcachefp, cachefile, 'r');
+				fclose(rcachefp);
+			} else if (rcachefp) {
+				/* append previous log to log.html and the new cache */
+				while (!feof(rcachefp)) {
+					n = fread(buf, 1, sizeof(buf), rcachefp);
+					if (ferror(rcachefp))
+						break;
+					if (fwrite(buf, 1, n, fp) != n ||
+					    fwrite(buf, 1, n, wcachefp) != n)
+						    break;
+				}
+				checkfileerror(rcachefp, cachefile, 'r');
+				fclose(rcachefp);
+			}
+			checkfileerror(wcachefp, tmppath, 'w');
+			fclose(wcachefp);
+		} else if (head) {
+			openlogstate(head);
+			writelog(&mainctx, fp, fpatom, head);
+			closelogstate();
 		}
 
-		/* write log to (temporary) cache */
-		if ((fd = mkstemp(tmppath)) == -1)
-			err(1, "mkstemp");
-		if (!(wcachefp = fdopen(fd, "w")))
-			err(1, "fdopen: '%s'", tmppath);
-		/* write last commit id (HEAD) */
-		git_oid_tostr(buf, sizeof(buf), head);
-		fprintf(wcachefp, "%s\n", buf);
+		fputs("</tbody></table>", fp);
+		writefooter(fp);
+		tmpfclose(fp, tmppage, "log.html");
 
-		writelog(fp, head);
+		writeatomfooter(fpatom);
+		tmpfclose(fpatom, tmpatom, "atom.xml");
 
-		if (rcachefp) {
-			/* append previous log to log.html and the new cache */
-			while (!feof(rcachefp)) {
-				n = fread(buf, 1, sizeof(buf), rcachefp);
-				if (ferror(rcachefp))
-					break;
-				if (fwrite(buf, 1, n, fp) != n ||
-				    fwrite(buf, 1, n, wcachefp) != n)
-					    break;
-			}
-			checkfileerror(rcachefp, cachefile, 'r');
-			fclose(rcachefp);
-		}
-		checkfileerror(wcachefp, tmppath, 'w');
-		fclose(wcachefp);
-	} else {
+		/* files for HEAD */
+		if (searchindex)
+			loadsearchstate();
+		fp = tmpfopen("files.html", tmppage, sizeof(tmppage));
+		writeheader(fp, mainctx.relpath, "Files");
 		if (head)
-			writelog(fp, head);
-	}
+			writefiles(&mainctx, fp, head);
+		writefooter(fp);
+		tmpfclose(fp, tmppage, "files.html");
 
-	fputs("</tbody></table>", fp);
-	writefooter(fp);
-	checkfileerror(fp, "log.html", 'w');
-	fclose(fp);
+		/* blame and Markdown pages of the files queued by writefiles() */
+		writeblames();
+		writemdpages(&mainctx);
 
-	/* files for HEAD */
-	fp = efopen("files.html", "w");
-	writeheader(fp, "Files");
-	if (head)
-		writefiles(fp, head);
-	writefooter(fp);
-	checkfileerror(fp, "files.html", 'w');
-	fclose(fp);
+		/* history of the files in HEAD */
+		if (filehist && head)
+			writehistory(&mainctx, head);
+	}
+
+	/* log pages of the branches, after HEAD which shares most commits */
+	if (cachefile && nlogbranches)
+		loadbranchescache();
+	for (n = 0; n < nlogbranches; n++)
+		writebranchlog(&mainctx, logbranches[n]);
+	if (cachefile && nlogbranches)
+		writebranchescache();
+	for (n = 0; n < logrowcap; n++)
+		free(logrows[n].summary);
+	free(logrows);
+
+	/* all pages are on disk after this, the state files and caches below
+	   are only replaced when every page was written */
+	if (outbackend)
+		outbackend->finish();
+
+	/* search index of the files in HEAD and the commits */
+	if (searchindex && (!postreceive || headupdated))
+		writesearch(&mainctx, head);
+
+	/* branches and tags, one snapshot for refs.html and tags.xml */
+	getrefspages(&refshtml, &refshtmllen, &tagsxml, &tagsxmllen);
 
 	/* summary page with branches and tags */
-	fp = efopen("refs.html", "w");
-	writeheader(fp, "Refs");
-	writerefs(fp);
+	fp = tmpfopen("refs.html", tmppage, sizeof(tmppage));
+	writeheader(fp, mainctx.relpath, "Refs");
+	fwrite(refshtml, 1, refshtmllen, fp);
 	writefooter(fp);
-	checkfileerror(fp, "refs.html", 'w');
-	fclose(fp);
-
-	/* Atom feed */
-	fp = efopen("atom.xml", "w");
-	writeatom(fp, 1);
-	checkfileerror(fp, "atom.xml", 'w');
-	fclose(fp);
+	tmpfclose(fp, tmppage, "refs.html");
 
 	/* Atom feed for tags / releases */
-	fp = efopen("tags.xml", "w");
-	writeatom(fp, 0);
-	checkfileerror(fp, "tags.xml", 'w');
-	fclose(fp);
+	fp = tmpfopen("tags.xml", tmppage, sizeof(tmppage));
+	writeatomheader(fp);
+	fwrite(tagsxml, 1, tagsxmllen, fp);
+	writeatomfooter(fp);
+	tmpfclose(fp, tmppage, "tags.xml");
+	free(refshtml);
+	free(tagsxml);
 
 	/* rename new cache file on success */
-	if (cachefile && head) {
+	if (cachefile && head && (!postreceive || headupdated)) {
 		if (rename(tmppath, cachefile))
 			err(1, "rename: '%s' to '%s'", tmppath, cachefile);
 		umask((mask = umask(0)));
 		if (chmod(cachefile,
 		    (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH) & ~mask))
 			err(1, "chmod: '%s'", cachefile);
+		if (filehist && rename(pathstmp, pathscache))
+			err(1, "rename: '%s' to '%s'", pathstmp, pathscache);
+	}
+	if (cachefile && nlogbranches && rename(branchestmp, branchescache))
+		err(1, "rename: '%s' to '%s'", branchestmp, branchescache);
+	if (!cachefile && head && (!postreceive || headupdated) &&
+	    rename(logstatetmp, logstate))
+		err(1, "rename: '%s' to '%s'", logstatetmp, logstate);
+	if (head && (!postreceive || headupdated) &&
+	    rename(filesstatetmp, filesstate))
+		err(1, "rename: '%s' to '%s'", filesstatetmp, filesstate);
+
+	if (syntax)
+		fprintf(stderr, "%s: highlighted %zu files in %lld ms, %zu from cache\n",
+		        argv[0], mainctx.hlfiles, mainctx.hltime / 1000, mainctx.hlcached);
+
+	if (collect && head)
+		collectgarbage(head);
+
+	writecommitset();
+
+	if (manifest)
+		writemanifest();
+
+	if (bundlefile)
+		writebundle();
+
+	if (durable)
+		writegeneration(head);
+
+	if (maxmemory && !getrusage(RUSAGE_SELF, &ru)) {
+		/* ru_maxrss is in kilobytes, on macOS in bytes */
+#ifdef __APPLE__
+		maxrss = ru.ru_maxrss / 1024;
+#else
+		maxrss = ru.ru_maxrss;
+#endif
+		fprintf(stderr, "%s: peak RSS %lld KB, budget %lld KB%s\n",
+		        argv[0], maxrss, maxmemory / 1024,
+		        maxrss > maxmemory / 1024 ? ", over budget" : "");
 	}
 
 	/* cleanup */
+	for (n = 0; n < LEN(repopool); n++)
+		git_repository_free(repopool[n]);
+	git_odb_free(budgetodb);
 	git_repository_free(repo);
 	git_libgit2_shutdown();
 